@@ -19,6 +19,21 @@ for header, funcs in pairs({
         end
     end
 end
+-- check optional functions
+for header, funcs in pairs({
+    ['sys/socket.h'] = {
+        'accept4',
+        'recvmmsg',
+        'sendmmsg',
+        'sendfile',
+    },
+}) do
+    if cfgh:check_header(header) then
+        for _, func in ipairs(funcs) do
+            cfgh:check_func(header, func)
+        end
+    end
+end
 assert(cfgh:flush('src/config.h'))
 
 -- create symbolic link to src/ directory
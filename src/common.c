@@ -25,11 +25,193 @@
 int poll_event_gc_lua(lua_State *L)
 {
     poll_event_t *ev = lua_touserdata(L, 1);
+    if (ev->enabled && ev->reg_evt.filter == EVFILT_SIGNAL) {
+        // restore the signal disposition of the event that is collected
+        // together with the poll instance
+        poll_signal_restore(ev);
+    }
     unref(L, ev->ref_poll);
     unref(L, ev->ref_udata);
+    unref(L, ev->ref_ctx);
     return 0;
 }
 
+// NOTE: the event is delivered by consume() after the kernel events. each
+// entry holds the event and the errno to be delivered with it.
+void poll_ready_push(lua_State *L, poll_t *p, int idx, int err)
+{
+    lua_pushvalue(L, idx);
+    pushref(L, p->ref_ready);
+    lua_insert(L, -2);
+    p->rtail++;
+    lua_rawseti(L, -2, p->rtail * 2 - 1);
+    lua_pushinteger(L, err);
+    lua_rawseti(L, -2, p->rtail * 2);
+    lua_pop(L, 1);
+}
+
+// move the events that are marked as still ready to the ready queue
+int poll_pending_flush(lua_State *L, poll_t *p)
+{
+    int n = p->npending;
+
+    if (!n) {
+        return 0;
+    }
+    pushref(L, p->ref_pending);
+    for (int i = 1; i <= n; i++) {
+        poll_event_t *ev = NULL;
+
+        lua_rawgeti(L, -1, i);
+        ev          = lua_touserdata(L, -1);
+        ev->pending = POLL_PENDING_QUEUED;
+        poll_ready_push(L, p, -1, 0);
+        lua_pop(L, 1);
+        lua_pushnil(L);
+        lua_rawseti(L, -2, i);
+    }
+    lua_pop(L, 1);
+    p->npending = 0;
+    return n;
+}
+
+// remove the entries of the event from the ready queue and the pending list
+void poll_ready_remove(lua_State *L, poll_t *p, poll_event_t *ev)
+{
+    int n = p->rhead;
+
+    pushref(L, p->ref_ready);
+    for (int i = p->rhead + 1; i <= p->rtail; i++) {
+        lua_rawgeti(L, -1, i * 2 - 1);
+        if (lua_touserdata(L, -1) == ev) {
+            lua_pop(L, 1);
+            continue;
+        } else if (++n == i) {
+            lua_pop(L, 1);
+            continue;
+        }
+        // move the entry forward
+        lua_rawseti(L, -2, n * 2 - 1);
+        lua_rawgeti(L, -1, i * 2);
+        lua_rawseti(L, -2, n * 2);
+    }
+    for (int i = n + 1; i <= p->rtail; i++) {
+        lua_pushnil(L);
+        lua_rawseti(L, -2, i * 2 - 1);
+        lua_pushnil(L);
+        lua_rawseti(L, -2, i * 2);
+    }
+    p->rtail = n;
+    if (p->rhead == p->rtail) {
+        p->rhead = p->rtail = 0;
+    }
+    lua_pop(L, 1);
+
+    if (ev->pending == POLL_PENDING_MARKED) {
+        n = 0;
+        pushref(L, p->ref_pending);
+        for (int i = 1; i <= p->npending; i++) {
+            lua_rawgeti(L, -1, i);
+            if (lua_touserdata(L, -1) == ev) {
+                lua_pop(L, 1);
+            } else {
+                lua_rawseti(L, -2, ++n);
+            }
+        }
+        for (int i = n + 1; i <= p->npending; i++) {
+            lua_pushnil(L);
+            lua_rawseti(L, -2, i);
+        }
+        p->npending = n;
+        lua_pop(L, 1);
+    }
+    ev->pending = 0;
+}
+
+// move the entries of the event at idx from the ready queue and the pending
+// list of src to those of dst
+static void ready_move(lua_State *L, poll_t *src, poll_t *dst, int idx)
+{
+    poll_event_t *ev = lua_touserdata(L, idx);
+    int pending      = ev->pending;
+
+    if (src->rhead != src->rtail) {
+        pushref(L, src->ref_ready);
+        for (int i = src->rhead + 1; i <= src->rtail; i++) {
+            lua_rawgeti(L, -1, i * 2 - 1);
+            if (lua_touserdata(L, -1) == ev) {
+                int err = 0;
+                lua_rawgeti(L, -2, i * 2);
+                err = lua_tointeger(L, -1);
+                lua_pop(L, 1);
+                if (err) {
+                    // the error is delivered by dst instead
+                    poll_ready_push(L, dst, idx, err);
+                }
+            }
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+    poll_ready_remove(L, src, ev);
+
+    if (pending == POLL_PENDING_QUEUED) {
+        ev->pending = pending;
+        poll_ready_push(L, dst, idx, 0);
+    } else if (pending == POLL_PENDING_MARKED) {
+        ev->pending = pending;
+        pushref(L, dst->ref_pending);
+        lua_pushvalue(L, idx);
+        lua_rawseti(L, -2, ++dst->npending);
+        lua_pop(L, 1);
+    }
+}
+
+int poll_event_mark_ready_lua(lua_State *L, const char *tname)
+{
+    poll_event_t *ev = luaL_checkudata(L, 1, tname);
+
+    if (!ev->enabled) {
+        lua_pushboolean(L, 0);
+        return 1;
+    } else if (!ev->pending) {
+        // NOTE: the event is re-delivered by the next wait without the kernel
+        // round trip
+        ev->pending = POLL_PENDING_MARKED;
+        pushref(L, ev->p->ref_pending);
+        lua_pushvalue(L, 1);
+        lua_rawseti(L, -2, ++ev->p->npending);
+        lua_pop(L, 1);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+void *poll_event_newctx(lua_State *L, poll_event_t *ev, poll_handler_t handler,
+                        size_t size)
+{
+    void *ctx = NULL;
+
+    poll_event_delctx(L, ev);
+    // create a table that anchors the context and its resources
+    lua_createtable(L, 0, 1);
+    ctx = lua_newuserdata(L, size);
+    memset(ctx, 0, size);
+    lua_setfield(L, -2, "ctx");
+    ev->ref_ctx = getref(L);
+    ev->ctx     = ctx;
+    ev->handler = handler;
+
+    return ctx;
+}
+
+void poll_event_delctx(lua_State *L, poll_event_t *ev)
+{
+    ev->handler = NULL;
+    ev->ctx     = NULL;
+    ev->ref_ctx = unref(L, ev->ref_ctx);
+}
+
 int poll_event_tostring_lua(lua_State *L, const char *tname)
 {
     poll_event_t *ev = luaL_checkudata(L, 1, tname);
@@ -82,9 +264,15 @@ int poll_event_revert_lua(lua_State *L, const char *tname)
         lua_pushinteger(L, errno);
         return 3;
     }
-    ev->reg_evt   = (event_t){0};
-    ev->occ_evt   = (event_t){0};
+    ev->reg_evt      = (event_t){0};
+    ev->occ_evt      = (event_t){0};
+    ev->sigign       = 0;
+    ev->autoident    = 0;
+    ev->idle_timeout = 0;
+    ev->holdoff      = 0;
+    sigemptyset(&ev->sigset);
     ev->ref_udata = unref(L, ev->ref_udata);
+    poll_event_delctx(L, ev);
     lua_settop(L, 1);
     luaL_getmetatable(L, POLL_EVENT_MT);
     lua_setmetatable(L, -2);
@@ -92,31 +280,48 @@ int poll_event_revert_lua(lua_State *L, const char *tname)
     return 1;
 }
 
-poll_event_t *poll_evset_get(lua_State *L, poll_t *p, event_t *evt)
+static int filter_index(int filter)
 {
-    int ref_evset = LUA_NOREF;
+    switch (filter) {
+    case EVFILT_READ:
+        return POLL_FREAD;
+    case EVFILT_WRITE:
+        return POLL_FWRITE;
+    case EVFILT_SIGNAL:
+        return POLL_FSIGNAL;
+    case EVFILT_TIMER:
+        return POLL_FTIMER;
+    default:
+        return POLL_FUSER;
+    }
+}
 
+static int evset_ref(lua_State *L, poll_t *p, int filter)
+{
     // get event set table reference
-    switch (evt->filter) {
+    switch (filter) {
     case EVFILT_READ:
-        ref_evset = p->ref_evset_read;
-        break;
+        return p->ref_evset_read;
     case EVFILT_WRITE:
-        ref_evset = p->ref_evset_write;
-        break;
+        return p->ref_evset_write;
     case EVFILT_SIGNAL:
-        ref_evset = p->ref_evset_signal;
-        break;
+        return p->ref_evset_signal;
     case EVFILT_TIMER:
-        ref_evset = p->ref_evset_timer;
-        break;
+        return p->ref_evset_timer;
+#if defined(EVFILT_USER)
+    case EVFILT_USER:
+        return p->ref_evset_user;
+#endif
 
     default:
-        luaL_error(L, "unsupported event filter: %d", evt->filter);
+        return luaL_error(L, "unsupported event filter: %d", filter);
     }
+}
 
+poll_event_t *poll_evset_get(lua_State *L, poll_t *p, event_t *evt)
+{
     // get poll_event_t at the ident index
-    pushref(L, ref_evset);
+    pushref(L, evset_ref(L, p, evt->filter));
     lua_rawgeti(L, -1, evt->ident);
     if (lua_isnil(L, -1)) {
         lua_pop(L, 2);
@@ -127,119 +332,613 @@ poll_event_t *poll_evset_get(lua_State *L, poll_t *p, event_t *evt)
     return lua_touserdata(L, -1);
 }
 
-static int evset_add(lua_State *L, poll_event_t *ev, int poll_event_idx)
+int poll_event_regs(poll_event_t *ev, event_t *regs)
 {
-    int ref_evset = LUA_NOREF;
+    int nregs = 0;
 
-    // get event set table reference
+    if (ev->handler == poll_relay_handler) {
+        // relay event watches both directions of the relayed descriptors
+        return poll_relay_regs(ev, regs);
+    } else if (ev->handler == poll_io_handler) {
+        // io event watches both directions of the descriptor
+        return poll_io_regs(ev, regs);
+    } else if (ev->reg_evt.filter != EVFILT_SIGNAL) {
+        regs[nregs++] = ev->reg_evt;
+        return nregs;
+    }
+
+    // signal event can watch multiple signals
+    for (int signo = 1; signo < NSIG; signo++) {
+        if (sigismember(&ev->sigset, signo) == 1) {
+            regs[nregs]       = ev->reg_evt;
+            regs[nregs].ident = signo;
+            nregs++;
+        }
+    }
+    return nregs;
+}
+
+// it returns the flags of send(2) that do not raise SIGPIPE on the socket,
+// or -1 if the descriptor is not a socket.
+int poll_sendflags(int fd)
+{
+    int type      = 0;
+    socklen_t len = sizeof(int);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == -1) {
+        return -1;
+    }
+#if defined(SO_NOSIGPIPE)
+    // NOTE: this also covers the writes that cannot take the flags, such as
+    // sendfile
+    type = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &type, sizeof(int));
+#endif
+#if defined(MSG_NOSIGNAL)
+    return MSG_NOSIGNAL;
+#else
+    return 0;
+#endif
+}
+
+// NOTE: sendflags must be the value returned by poll_sendflags()
+ssize_t poll_writev(int fd, int sendflags, const struct iovec *iov, int iovcnt)
+{
+    if (sendflags != -1) {
+        struct msghdr msg = {
+            .msg_iov    = (struct iovec *)iov,
+            .msg_iovlen = iovcnt,
+        };
+        return sendmsg(fd, &msg, sendflags);
+    }
+    return writev(fd, iov, iovcnt);
+}
+
+#define NRESULT 64
+
+int poll_apply_changes(int fd, event_t *changes, int nchg)
+{
+    event_t results[NRESULT];
+    int nerr = 0;
+    int err  = 0;
+
+    for (int i = 0; i < nchg; i++) {
+        changes[i].flags |= EV_RECEIPT;
+    }
+
+    for (int off = 0; off < nchg; off += NRESULT) {
+        int n    = (nchg - off < NRESULT) ? nchg - off : NRESULT;
+        int nres = 0;
+
+        while ((nres = kevent(fd, changes + off, n, results, n, NULL)) == -1) {
+            if (errno != EINTR) {
+                return -1;
+            }
+        }
+
+        // NOTE: the receipts are returned in the order of the changelist
+        for (int i = 0; i < nres; i++) {
+            event_t *chg = changes + off + i;
+            chg->flags &= ~EV_RECEIPT;
+            chg->flags |= EV_ERROR;
+            chg->data = results[i].data;
+            if (chg->data) {
+                if (!nerr) {
+                    err = chg->data;
+                }
+                nerr++;
+            }
+        }
+    }
+
+    errno = err;
+    return nerr;
+}
+
+static poll_idpool_t *idpool(poll_t *p, int filter)
+{
+    return &p->idpool[(filter == EVFILT_TIMER) ? 0 : 1];
+}
+
+static void ident_free(lua_State *L, poll_t *p, int filter, uintptr_t ident)
+{
+    poll_idpool_t *pool = idpool(p, filter);
+
+    if (pool->nfree == pool->size) {
+        // grow the list
+        int size        = (pool->size) ? pool->size * 2 : 16;
+        uintptr_t *list = lua_newuserdata(L, sizeof(uintptr_t) * size);
+        if (pool->nfree) {
+            memcpy(list, pool->free, sizeof(uintptr_t) * pool->nfree);
+        }
+        pool->ref_free = unref(L, pool->ref_free);
+        pool->ref_free = getref(L);
+        pool->free     = list;
+        pool->size     = size;
+    }
+    pool->free[pool->nfree++] = ident;
+}
+
+static uintptr_t ident_alloc(lua_State *L, poll_t *p, int filter)
+{
+    poll_idpool_t *pool = idpool(p, filter);
+    uintptr_t ident     = 0;
+    int used            = 0;
+
+    pushref(L, evset_ref(L, p, filter));
+    // NOTE: the ident may be used by the event that has an explicit ident or
+    // that has been moved from the other kqueue instance. such idents are
+    // dropped from the list, and are released again by ident_release() when
+    // the event is released.
+    while (pool->nfree) {
+        ident = pool->free[--pool->nfree];
+        lua_rawgeti(L, -1, ident);
+        used = !lua_isnil(L, -1);
+        lua_pop(L, 1);
+        if (!used) {
+            lua_pop(L, 1);
+            return ident;
+        }
+    }
+    do {
+        ident = ++pool->last;
+        lua_rawgeti(L, -1, ident);
+        used = !lua_isnil(L, -1);
+        lua_pop(L, 1);
+    } while (used);
+    lua_pop(L, 1);
+
+    return ident;
+}
+
+// release the ident of the event that is removed from the event set table
+static void ident_release(lua_State *L, poll_t *p, poll_event_t *ev)
+{
     switch (ev->reg_evt.filter) {
-    case EVFILT_READ:
-        ref_evset = ev->p->ref_evset_read;
-        break;
-    case EVFILT_WRITE:
-        ref_evset = ev->p->ref_evset_write;
-        break;
-    case EVFILT_SIGNAL:
-        ref_evset = ev->p->ref_evset_signal;
-        break;
     case EVFILT_TIMER:
-        ref_evset = ev->p->ref_evset_timer;
-        break;
-
-    default:
-        luaL_error(L, "unsupported event filter: %d", ev->reg_evt.filter);
+#if defined(EVFILT_USER)
+    case EVFILT_USER:
+#endif
+        // the explicit ident in the range of the allocated idents has been
+        // skipped or dropped by ident_alloc()
+        if (ev->autoident ||
+            ev->reg_evt.ident <= idpool(p, ev->reg_evt.filter)->last) {
+            ident_free(L, p, ev->reg_evt.filter, ev->reg_evt.ident);
+        }
     }
+}
 
-    // set poll_event_t at the ident index
-    pushref(L, ref_evset);
-    lua_rawgeti(L, -1, ev->reg_evt.ident);
-    if (!lua_isnil(L, -1)) {
+static int evset_add(lua_State *L, poll_event_t *ev, int poll_event_idx)
+{
+    event_t regs[POLL_MAX_REGS];
+    int nregs               = poll_event_regs(ev, regs);
+    int nfreg[POLL_NFILTER] = {0};
+
+    // check that all idents are not registered
+    for (int i = 0; i < nregs; i++) {
+        pushref(L, evset_ref(L, ev->p, regs[i].filter));
+        lua_rawgeti(L, -1, regs[i].ident);
+        if (!lua_isnil(L, -1)) {
+            lua_pop(L, 2);
+            return POLL_EALREADY;
+        }
         lua_pop(L, 2);
-        return POLL_EALREADY;
+        nfreg[filter_index(regs[i].filter)]++;
+    }
+    // check the limit of registrations
+    for (int i = 0; i < POLL_NFILTER && !ev->internal; i++) {
+        if (ev->p->maxreg[i] && nfreg[i] &&
+            ev->p->nfreg[i] + nfreg[i] > ev->p->maxreg[i]) {
+            errno = ENOBUFS;
+            return POLL_ERROR;
+        }
     }
-    lua_pop(L, 1);
     // set poll_event_t at the ident index
-    lua_pushvalue(L, poll_event_idx);
-    lua_rawseti(L, -2, ev->reg_evt.ident);
+    for (int i = 0; i < nregs; i++) {
+        pushref(L, evset_ref(L, ev->p, regs[i].filter));
+        lua_pushvalue(L, poll_event_idx);
+        lua_rawseti(L, -2, regs[i].ident);
+        lua_pop(L, 1);
+    }
     // increment registered event counter
-    ev->p->nreg++;
-    lua_pop(L, 1);
+    if (ev->internal) {
+        // NOTE: the internal event is not visible to the caller
+        ev->p->nintern += nregs;
+    } else {
+        ev->p->nreg += nregs;
+        ev->p->nevent++;
+        for (int i = 0; i < POLL_NFILTER; i++) {
+            ev->p->nfreg[i] += nfreg[i];
+        }
+    }
+
+    if (ev->reg_evt.filter == EVFILT_SIGNAL) {
+        poll_signal_ignore(ev);
+    }
     return POLL_OK;
 }
 
 int poll_watch_event(lua_State *L, poll_event_t *ev, int poll_event_idx)
 {
-    event_t evt = ev->reg_evt;
+    event_t regs[POLL_MAX_REGS];
+    int nregs = 0;
 
     // check event is not already registered
-    if (ev->enabled || evset_add(L, ev, poll_event_idx) != POLL_OK) {
+    if (ev->enabled) {
+        errno = EEXIST;
+        return POLL_EALREADY;
+    } else if (ev->autoident) {
+        // allocate an ident that is not used
+        ev->reg_evt.ident = ident_alloc(L, ev->p, ev->reg_evt.filter);
+    }
+    nregs = poll_event_regs(ev, regs);
+    switch (evset_add(L, ev, poll_event_idx)) {
+    case POLL_OK:
+        break;
+    case POLL_EALREADY:
         // return error if already registered
         errno = EEXIST;
         return POLL_EALREADY;
+    default:
+        // exceeded the limit of registrations
+        if (ev->autoident) {
+            ident_free(L, ev->p, ev->reg_evt.filter, ev->reg_evt.ident);
+        }
+        return POLL_ERROR;
     }
 
     // register event
-    evt.flags |= EV_ADD;
-    while (kevent(ev->p->fd, &evt, 1, NULL, 0, NULL) == -1) {
-        if (errno != EINTR) {
-            poll_evset_del(L, ev);
-            return POLL_ERROR;
+    for (int i = 0; i < nregs; i++) {
+        regs[i].flags |= EV_ADD;
+    }
+    switch (poll_apply_changes(ev->p->fd, regs, nregs)) {
+    case 0:
+        break;
+
+    case -1:
+        poll_evset_del(L, ev);
+        return POLL_ERROR;
+
+    default: {
+        // rollback the registered events
+        int err  = errno;
+        int ndel = 0;
+        for (int i = 0; i < nregs; i++) {
+            if (regs[i].data == 0) {
+                regs[ndel]       = regs[i];
+                regs[ndel].flags = EV_DELETE;
+                ndel++;
+            }
+        }
+        if (ndel) {
+            poll_apply_changes(ev->p->fd, regs, ndel);
         }
+        poll_evset_del(L, ev);
+        errno = err;
+        return POLL_ERROR;
+    }
     }
     ev->enabled = 1;
+    poll_idle_arm(L, ev);
 
     return POLL_OK;
 }
 
+// remove the event from the event set tables of p only
+static void evset_remove(lua_State *L, poll_t *p, poll_event_t *ev)
+{
+    event_t regs[POLL_MAX_REGS];
+    int nregs = poll_event_regs(ev, regs);
+
+    // remove poll_event_t at the ident index
+    for (int i = 0; i < nregs; i++) {
+        pushref(L, evset_ref(L, p, regs[i].filter));
+        lua_pushnil(L);
+        lua_rawseti(L, -2, regs[i].ident);
+        lua_pop(L, 1);
+        if (!ev->internal) {
+            p->nfreg[filter_index(regs[i].filter)]--;
+        }
+    }
+    if (ev->internal) {
+        p->nintern -= nregs;
+    } else {
+        p->nreg -= nregs;
+        p->nevent--;
+    }
+}
+
 void poll_evset_del(lua_State *L, poll_event_t *ev)
 {
-    int ref_evset = LUA_NOREF;
+    evset_remove(L, ev->p, ev);
+    // recycle the ident
+    ident_release(L, ev->p, ev);
 
-    // get event set table reference
-    switch (ev->reg_evt.filter) {
-    case EVFILT_READ:
-        ref_evset = ev->p->ref_evset_read;
-        break;
-    case EVFILT_WRITE:
-        ref_evset = ev->p->ref_evset_write;
-        break;
-    case EVFILT_SIGNAL:
-        ref_evset = ev->p->ref_evset_signal;
-        break;
-    case EVFILT_TIMER:
-        ref_evset = ev->p->ref_evset_timer;
-        break;
+    if (ev->reg_evt.filter == EVFILT_SIGNAL) {
+        poll_signal_restore(ev);
+    }
+    poll_idle_disarm(ev);
+}
 
-    default:
-        luaL_error(L, "unsupported event filter: %d", ev->reg_evt.filter);
+int poll_move_events(lua_State *L, poll_t *src, int dst_idx, int list, int n,
+                     int *nfail)
+{
+    poll_t *dst = lua_touserdata(L, dst_idx);
+    int top     = lua_gettop(L);
+    event_t regs[POLL_MAX_REGS];
+    event_t *adds = NULL;
+    event_t *dels = NULL;
+    int nev       = 0;
+    int total     = 0;
+    int nmoved    = 0;
+    int ndel      = 0;
+    int off       = 0;
+    int err       = 0;
+
+    *nfail = 0;
+    // place the events at the ident index of the event set tables of dst, and
+    // compact the list to the events to be moved
+    for (int i = 1; i <= n; i++) {
+        poll_event_t *ev = NULL;
+        int rc           = POLL_OK;
+
+        lua_rawgeti(L, list, i);
+        ev = lua_touserdata(L, -1);
+        if (!ev->enabled || ev->p != src ||
+            ev->handler == poll_jobq_handler) {
+            // the internal event of the job completion cannot be moved
+            lua_pop(L, 1);
+            continue;
+        }
+        ev->p = dst;
+        rc    = evset_add(L, ev, lua_gettop(L));
+        ev->p = src;
+        if (rc != POLL_OK) {
+            // ident is already registered in dst or exceeded the limit
+            if (!err) {
+                err = (rc == POLL_EALREADY) ? EEXIST : errno;
+            }
+            (*nfail)++;
+            lua_pop(L, 1);
+            continue;
+        }
+        total += poll_event_regs(ev, regs);
+        lua_rawseti(L, list, ++nev);
+    }
+    if (!nev) {
+        errno = err;
+        return 0;
     }
 
-    // get poll_event_t at the ident index
-    pushref(L, ref_evset);
-    lua_pushnil(L);
-    lua_rawseti(L, -2, ev->reg_evt.ident);
-    ev->p->nreg--;
-    lua_pop(L, 1);
+    // register all events to dst at once
+    adds = lua_newuserdata(L, sizeof(event_t) * total * 2);
+    dels = adds + total;
+    for (int i = 1; i <= nev; i++) {
+        lua_rawgeti(L, list, i);
+        off += poll_event_regs(lua_touserdata(L, -1), adds + off);
+        lua_pop(L, 1);
+    }
+    for (int i = 0; i < total; i++) {
+        adds[i].flags |= EV_ADD;
+        dels[i]       = adds[i];
+        dels[i].flags = EV_DELETE;
+    }
+    if (poll_apply_changes(dst->fd, adds, total) == -1) {
+        err = errno;
+        for (int i = 1; i <= nev; i++) {
+            poll_event_t *ev = NULL;
+            lua_rawgeti(L, list, i);
+            ev = lua_touserdata(L, -1);
+            // NOTE: the idle timer, the ident and the signal disposition of
+            // the event still belong to src
+            evset_remove(L, dst, ev);
+            lua_pop(L, 1);
+        }
+        lua_settop(L, top);
+        errno = err;
+        return -1;
+    }
+
+    off = 0;
+    for (int i = 1; i <= nev; i++) {
+        poll_event_t *ev = NULL;
+        int nregs        = 0;
+        int failed       = 0;
+
+        lua_rawgeti(L, list, i);
+        ev    = lua_touserdata(L, -1);
+        nregs = poll_event_regs(ev, regs);
+        for (int j = off; j < off + nregs; j++) {
+            if (adds[j].data) {
+                failed = 1;
+                if (!err) {
+                    err = adds[j].data;
+                }
+            }
+        }
+
+        if (failed) {
+            // rollback the registrations in dst
+            int nrb = 0;
+            for (int j = off; j < off + nregs; j++) {
+                if (!adds[j].data) {
+                    regs[nrb++] = dels[j];
+                }
+            }
+            if (nrb) {
+                poll_apply_changes(dst->fd, regs, nrb);
+            }
+            evset_remove(L, dst, ev);
+            (*nfail)++;
+        } else {
+            memmove(dels + ndel, dels + off, sizeof(event_t) * nregs);
+            ndel += nregs;
+            poll_evset_del(L, ev);
+            // the ready entries of the event are delivered by dst
+            ready_move(L, src, dst, lua_gettop(L));
+            // replace poll instance
+            ev->p        = dst;
+            ev->ref_poll = unref(L, ev->ref_poll);
+            lua_pushvalue(L, dst_idx);
+            ev->ref_poll = getref(L);
+            poll_idle_arm(L, ev);
+            nmoved++;
+        }
+        off += nregs;
+        lua_pop(L, 1);
+    }
+
+    // unregister the moved events from src at once
+    // NOTE: the errors of each change are ignored as poll_unwatch_event()
+    if (ndel) {
+        poll_apply_changes(src->fd, dels, ndel);
+    }
+    lua_settop(L, top);
+    errno = err;
+    return nmoved;
+}
+
+// register the events in the list to the kqueue instance at once.
+// it returns the number of watched events, and the errno of each failed
+// event is stored at the same index of the table at errs if errs is not 0.
+int poll_watch_events(lua_State *L, poll_t *p, int list, int n, int errs,
+                      int *nfail)
+{
+    int top = lua_gettop(L);
+    event_t regs[POLL_MAX_REGS];
+    event_t *adds = NULL;
+    int *errcodes = lua_newuserdata(L, sizeof(int) * (n + 1));
+    int total     = 0;
+    int nwatched  = 0;
+    int off       = 0;
+    int err       = 0;
+
+    *nfail = 0;
+    memset(errcodes, 0, sizeof(int) * (n + 1));
+    for (int i = 1; i <= n; i++) {
+        poll_event_t *ev = NULL;
+        int rc           = POLL_OK;
+
+        lua_rawgeti(L, list, i);
+        ev = lua_touserdata(L, -1);
+        if (ev->enabled || ev->p != p || !ev->reg_evt.filter) {
+            // already watched, belongs to the other instance or not
+            // configured
+            errcodes[i] = (ev->enabled) ? EEXIST : EINVAL;
+            lua_pop(L, 1);
+            continue;
+        } else if (ev->autoident) {
+            // allocate an ident that is not used
+            ev->reg_evt.ident = ident_alloc(L, p, ev->reg_evt.filter);
+        }
+        rc = evset_add(L, ev, lua_gettop(L));
+        if (rc != POLL_OK) {
+            // ident is already registered or exceeded the limit
+            errcodes[i] = (rc == POLL_EALREADY) ? EEXIST : errno;
+            if (ev->autoident) {
+                ident_free(L, p, ev->reg_evt.filter, ev->reg_evt.ident);
+            }
+        } else {
+            total += poll_event_regs(ev, regs);
+        }
+        lua_pop(L, 1);
+    }
+
+    if (total) {
+        adds = lua_newuserdata(L, sizeof(event_t) * total);
+        for (int i = 1; i <= n; i++) {
+            if (!errcodes[i]) {
+                lua_rawgeti(L, list, i);
+                off += poll_event_regs(lua_touserdata(L, -1), adds + off);
+                lua_pop(L, 1);
+            }
+        }
+        for (int i = 0; i < total; i++) {
+            adds[i].flags |= EV_ADD;
+        }
+        if (poll_apply_changes(p->fd, adds, total) == -1) {
+            // all registrations are failed
+            for (int i = 0; i < total; i++) {
+                adds[i].data = errno;
+            }
+        }
+    }
+
+    off = 0;
+    for (int i = 1; i <= n; i++) {
+        poll_event_t *ev = NULL;
+        int nregs        = 0;
+        int nrb          = 0;
+
+        if (errcodes[i]) {
+            continue;
+        }
+        lua_rawgeti(L, list, i);
+        ev    = lua_touserdata(L, -1);
+        nregs = poll_event_regs(ev, regs);
+        for (int j = off; j < off + nregs; j++) {
+            if (adds[j].data) {
+                if (!errcodes[i]) {
+                    errcodes[i] = adds[j].data;
+                }
+            } else {
+                regs[nrb]       = adds[j];
+                regs[nrb].flags = EV_DELETE;
+                nrb++;
+            }
+        }
+        if (errcodes[i]) {
+            // rollback the registrations of the failed event
+            if (nrb) {
+                poll_apply_changes(p->fd, regs, nrb);
+            }
+            poll_evset_del(L, ev);
+        } else {
+            ev->enabled = 1;
+            poll_idle_arm(L, ev);
+            nwatched++;
+        }
+        off += nregs;
+        lua_pop(L, 1);
+    }
+
+    // report the errors of the failed events
+    for (int i = 1; i <= n; i++) {
+        if (errcodes[i]) {
+            if (!err) {
+                err = errcodes[i];
+            }
+            (*nfail)++;
+            if (errs) {
+                lua_pushinteger(L, errcodes[i]);
+                lua_rawseti(L, errs, i);
+            }
+        }
+    }
+    lua_settop(L, top);
+    errno = err;
+    return nwatched;
 }
 
 int poll_unwatch_event(lua_State *L, poll_event_t *ev)
 {
+    event_t regs[POLL_MAX_REGS];
+    int nregs = 0;
+
     if (!ev->enabled) {
         // not watched
         return POLL_EALREADY;
     }
 
     // unregister event
-    event_t evt = ev->reg_evt;
-    evt.flags   = EV_DELETE;
-    while (kevent(ev->p->fd, &evt, 1, NULL, 0, NULL) != 0) {
-        if (errno == EINTR) {
-            continue;
-        } else if (errno == ENOMEM) {
-            return POLL_ERROR;
-        }
-        // probably event is already deleted
-        break;
+    nregs = poll_event_regs(ev, regs);
+    for (int i = 0; i < nregs; i++) {
+        regs[i].flags = EV_DELETE;
+    }
+    // NOTE: the errors of each change are ignored since the event is probably
+    // already deleted
+    if (poll_apply_changes(ev->p->fd, regs, nregs) == -1 && errno == ENOMEM) {
+        return POLL_ERROR;
     }
     ev->enabled = 0;
     poll_evset_del(L, ev);
@@ -297,6 +996,142 @@ int poll_event_unwatch_lua(lua_State *L, const char *tname)
     return 1;
 }
 
+int poll_checktrigger(lua_State *L, int idx, const char *field, int flags)
+{
+    static const char *const triggers[] = {
+        "level",
+        "edge",
+        "oneshot",
+        NULL,
+    };
+    const char *trigger = NULL;
+
+    lua_getfield(L, idx, field);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return flags;
+    } else if (lua_type(L, -1) != LUA_TSTRING) {
+        return luaL_argerror(L, idx,
+                             lua_pushfstring(L, "%s must be string", field));
+    }
+    trigger = lua_tostring(L, -1);
+    lua_pop(L, 1);
+
+    flags &= ~(EV_ONESHOT | EV_CLEAR);
+    for (int i = 0; triggers[i]; i++) {
+        if (strcmp(trigger, triggers[i]) == 0) {
+            switch (i) {
+            case 1:
+                return flags | EV_CLEAR;
+            case 2:
+                return flags | EV_ONESHOT;
+            default:
+                return flags;
+            }
+        }
+    }
+    return luaL_argerror(
+        L, idx, lua_pushfstring(L, "invalid %s %s", field, trigger));
+}
+
+int poll_modify_event(lua_State *L, poll_event_t *ev, event_t evt)
+{
+    event_t regs[POLL_MAX_REGS];
+    event_t changes[POLL_MAX_REGS * 2];
+    int nregs = 0;
+    int nchg  = 0;
+
+    if (!ev->enabled) {
+        // update the registered event only
+        ev->reg_evt = evt;
+        return POLL_OK;
+    }
+
+    // NOTE: EV_ADD updates the existing registration in-place, but the trigger
+    // flags and EV_DISPATCH are not updated. the old registration must be
+    // deleted in the same changelist in that case.
+    nregs = poll_event_regs(ev, regs);
+    if ((evt.flags ^ ev->reg_evt.flags) &
+        (EV_ONESHOT | EV_CLEAR | EV_DISPATCH)) {
+        for (int i = 0; i < nregs; i++) {
+            changes[nchg]       = regs[i];
+            changes[nchg].flags = EV_DELETE;
+            nchg++;
+        }
+    }
+    for (int i = 0; i < nregs; i++) {
+        changes[nchg]       = evt;
+        changes[nchg].ident = regs[i].ident;
+        changes[nchg].flags |= EV_ADD;
+        nchg++;
+    }
+
+    if (poll_apply_changes(ev->p->fd, changes, nchg) != 0) {
+        int err = errno;
+
+        // restore the old registration or disable the event if it cannot be
+        // restored
+        for (int i = 0; i < nregs; i++) {
+            regs[i].flags |= EV_ADD;
+        }
+        if (poll_apply_changes(ev->p->fd, regs, nregs) != 0) {
+            ev->enabled = 0;
+            poll_evset_del(L, ev);
+        }
+        errno = err;
+        return POLL_ERROR;
+    }
+    ev->reg_evt = evt;
+
+    return POLL_OK;
+}
+
+int poll_event_modify_lua(lua_State *L, const char *tname)
+{
+    poll_event_t *ev = luaL_checkudata(L, 1, tname);
+    event_t evt      = ev->reg_evt;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+
+    evt.flags = poll_checktrigger(L, 2, "trigger", evt.flags);
+    if (evt.filter == EVFILT_TIMER) {
+        lua_getfield(L, 2, "sec");
+        if (lua_type(L, -1) == LUA_TNUMBER) {
+            lua_Number sec = lua_tonumber(L, -1);
+            if (sec < 0) {
+                errno = EINVAL;
+                lua_pushboolean(L, 0);
+                lua_pushstring(L, strerror(errno));
+                lua_pushinteger(L, errno);
+                return 3;
+            }
+            evt.data = sec * 1000;
+        } else if (!lua_isnil(L, -1)) {
+            return luaL_argerror(L, 2, "sec must be number");
+        }
+        lua_pop(L, 1);
+    }
+
+    if (poll_modify_event(L, ev, evt) != POLL_OK) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, strerror(errno));
+        lua_pushinteger(L, errno);
+        return 3;
+    }
+
+    // replace udata
+    lua_getfield(L, 2, "udata");
+    if (!lua_isnil(L, -1)) {
+        int ref       = getref(L);
+        ev->ref_udata = unref(L, ev->ref_udata);
+        ev->ref_udata = ref;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 int poll_event_is_enabled_lua(lua_State *L, const char *tname)
 {
     poll_event_t *ev = luaL_checkudata(L, 1, tname);
@@ -95,6 +95,8 @@ void libopen_poll_event(lua_State *L)
         {"as_write",   poll_write_new },
         {"as_signal",  poll_signal_new},
         {"as_timer",   poll_timer_new },
+        {"as_user",    poll_user_new  },
+        {"as_io",      poll_io_new    },
         {NULL,         NULL           }
     };
 
@@ -0,0 +1,509 @@
+/**
+ *  Copyright (C) 2023 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "lua_kqueue.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+// maximum number of the records per message
+#define NRECORD 64
+
+#define HANDOFF_MAGIC 0x6b71686f
+
+// type of the exported events
+#define H_READ  0
+#define H_WRITE 1
+#define H_TIMER 2
+#define H_USER  3
+#define H_IO    4
+
+static const char *const HANDOFF_MT[] = {
+    POLL_READ_MT, POLL_WRITE_MT, POLL_TIMER_MT, POLL_USER_MT, POLL_IO_MT,
+};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t nrec; // number of the records, 0 for the end of the handoff
+    uint32_t nfd;  // number of the descriptors attached to the message
+    uint32_t len;  // length of the records
+} handoff_hdr_t;
+
+// NOTE: the udata of ulen bytes follows the record. the ident of the
+// descriptor event is the index of the descriptor in the handoff, so the
+// events of the same descriptor share the received descriptor.
+typedef struct {
+    uint32_t type;
+    uint32_t flags;
+    uint32_t fflags;
+    uint32_t mask;
+    int64_t ident;
+    int64_t data;
+    double idle_timeout;
+    uint32_t utype;
+    uint32_t ulen;
+} handoff_rec_t;
+
+typedef union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * NRECORD)];
+} handoff_cmsg_t;
+
+static int write_all(int sock, int sendflags, const char *buf, size_t len)
+{
+    while (len) {
+        struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+        ssize_t n        = poll_writev(sock, sendflags, &iov, 1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int sock, char *buf, size_t len)
+{
+    while (len) {
+        ssize_t n = read(sock, buf, len);
+        if (n == 0) {
+            errno = ECONNRESET;
+            return -1;
+        } else if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void close_fds(int *fds, int nfd)
+{
+    for (int i = 0; i < nfd; i++) {
+        close(fds[i]);
+    }
+}
+
+// NOTE: the exporting process must not be killed by SIGPIPE if the successor
+// exits during the handoff
+static int send_chunk(int sock, int sendflags, handoff_hdr_t *hdr, int *fds,
+                      const char *body)
+{
+    struct iovec iov  = {.iov_base = hdr, .iov_len = sizeof(handoff_hdr_t)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    handoff_cmsg_t cmsg;
+    ssize_t n = 0;
+
+    memset(&cmsg, 0, sizeof(cmsg));
+    if (hdr->nfd) {
+        // attach the descriptors to the header
+        struct cmsghdr *c  = NULL;
+        msg.msg_control    = cmsg.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * hdr->nfd);
+        c                  = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level      = SOL_SOCKET;
+        c->cmsg_type       = SCM_RIGHTS;
+        c->cmsg_len        = CMSG_LEN(sizeof(int) * hdr->nfd);
+        memcpy(CMSG_DATA(c), fds, sizeof(int) * hdr->nfd);
+    }
+    while ((n = sendmsg(sock, &msg, (sendflags == -1) ? 0 : sendflags)) ==
+           -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    // send the rest of the header and the records
+    if (write_all(sock, sendflags, (char *)hdr + n,
+                  sizeof(handoff_hdr_t) - n) == -1 ||
+        write_all(sock, sendflags, body, hdr->len) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+static int recv_header(int sock, handoff_hdr_t *hdr, int *fds)
+{
+    struct iovec iov  = {.iov_base = hdr, .iov_len = sizeof(handoff_hdr_t)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    handoff_cmsg_t cmsg;
+    ssize_t n = 0;
+    int nfd   = 0;
+
+    memset(&cmsg, 0, sizeof(cmsg));
+    msg.msg_control    = cmsg.buf;
+    msg.msg_controllen = sizeof(cmsg.buf);
+    while ((n = recvmsg(sock, &msg, 0)) == -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    if (n == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            int k = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < k; i++) {
+                int fd = -1;
+                memcpy(&fd, CMSG_DATA(c) + sizeof(int) * i, sizeof(int));
+                if (nfd < NRECORD) {
+                    fds[nfd++] = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+    }
+
+    if (read_all(sock, (char *)hdr + n, sizeof(handoff_hdr_t) - n) == -1) {
+        close_fds(fds, nfd);
+        return -1;
+    } else if ((msg.msg_flags & MSG_CTRUNC) || hdr->magic != HANDOFF_MAGIC ||
+               hdr->nrec > NRECORD || hdr->nfd != (uint32_t)nfd) {
+        close_fds(fds, nfd);
+        errno = EBADMSG;
+        return -1;
+    }
+    for (int i = 0; i < nfd; i++) {
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    return nfd;
+}
+
+static int event_type(poll_event_t *ev)
+{
+    if (ev->handler == poll_io_handler) {
+        return H_IO;
+    } else if (ev->handler == poll_relay_handler ||
+               ev->handler == poll_jobq_handler ||
+               ev->handler == poll_op_handler) {
+        // relay, job completion and operation hold the internal state
+        return -1;
+    }
+
+    switch (ev->reg_evt.filter) {
+    case EVFILT_READ:
+        return H_READ;
+    case EVFILT_WRITE:
+        return H_WRITE;
+    case EVFILT_TIMER:
+        return H_TIMER;
+#if defined(EVFILT_USER)
+    case EVFILT_USER:
+        return H_USER;
+#endif
+    default:
+        // signal event is bound to the process
+        return -1;
+    }
+}
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t size;
+} handoff_buf_t;
+
+static int buf_add(handoff_buf_t *b, const void *data, size_t len)
+{
+    if (b->len + len > b->size) {
+        size_t size = (b->size) ? b->size : 4096;
+        char *buf   = NULL;
+        while (size < b->len + len) {
+            size *= 2;
+        }
+        if (!(buf = realloc(b->buf, size))) {
+            return -1;
+        }
+        b->buf  = buf;
+        b->size = size;
+    }
+    if (len) {
+        memcpy(b->buf + b->len, data, len);
+        b->len += len;
+    }
+    return 0;
+}
+
+int poll_export_lua(lua_State *L)
+{
+    poll_t *p         = luaL_checkudata(L, 1, POLL_MT);
+    int sock          = luaL_checkinteger(L, 2);
+    int refs[]        = {p->ref_evset_read, p->ref_evset_write,
+                         p->ref_evset_timer, p->ref_evset_user};
+    handoff_hdr_t hdr = {.magic = HANDOFF_MAGIC};
+    handoff_buf_t b   = {0};
+    int sendflags     = poll_sendflags(sock);
+    int nsent         = 0;
+    int fds[NRECORD];
+    int n = 0;
+
+    lua_settop(L, 2);
+    // set of exported events
+    lua_newtable(L);
+    // index of the exported descriptors
+    lua_newtable(L);
+    for (int i = 0; i < 4; i++) {
+        pushref(L, refs[i]);
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+            poll_event_t *ev  = lua_touserdata(L, -1);
+            handoff_rec_t rec = {0};
+            const char *udata = NULL;
+            size_t ulen       = 0;
+            int type          = event_type(ev);
+            int64_t ident     = 0;
+
+            lua_pushvalue(L, -1);
+            lua_rawget(L, 3);
+            if (type < 0 || lua_toboolean(L, -1)) {
+                lua_pop(L, 2);
+                continue;
+            }
+            lua_pop(L, 1);
+            lua_pushboolean(L, 1);
+            lua_rawset(L, 3);
+
+            ident = ev->reg_evt.ident;
+            if (type != H_TIMER && type != H_USER) {
+                // send the descriptor only once
+                lua_rawgeti(L, 4, ev->reg_evt.ident);
+                if (lua_isnil(L, -1)) {
+                    lua_pop(L, 1);
+                    fds[hdr.nfd++] = ev->reg_evt.ident;
+                    lua_pushinteger(L, nsent++);
+                    lua_pushvalue(L, -1);
+                    lua_rawseti(L, 4, ev->reg_evt.ident);
+                }
+                ident = lua_tointeger(L, -1);
+                lua_pop(L, 1);
+            }
+            rec = (handoff_rec_t){
+                .type         = type,
+                .flags        = ev->reg_evt.flags & (EV_ONESHOT | EV_CLEAR),
+                .fflags       = ev->reg_evt.fflags,
+                .mask         = (type == H_IO) ? poll_io_mask(ev) : 0,
+                .ident        = ident,
+                .data         = ev->reg_evt.data,
+                .idle_timeout = ev->idle_timeout,
+                .utype        = LUA_TNIL,
+            };
+            // NOTE: only the string or number udata can be exported as a key
+            pushref(L, ev->ref_udata);
+            switch (lua_type(L, -1)) {
+            case LUA_TNUMBER:
+            case LUA_TSTRING:
+                rec.utype = lua_type(L, -1);
+                udata     = lua_tolstring(L, -1, &ulen);
+                rec.ulen  = ulen;
+            }
+            if (buf_add(&b, &rec, sizeof(rec)) == -1 ||
+                buf_add(&b, udata, ulen) == -1) {
+                goto FAIL;
+            }
+            lua_pop(L, 1);
+            n++;
+
+            if (++hdr.nrec == NRECORD) {
+                hdr.len = b.len;
+                if (send_chunk(sock, sendflags, &hdr, fds, b.buf) == -1) {
+                    goto FAIL;
+                }
+                hdr.nrec = hdr.nfd = 0;
+                b.len              = 0;
+            }
+        }
+        lua_pop(L, 1);
+    }
+
+    hdr.len = b.len;
+    if (hdr.nrec && send_chunk(sock, sendflags, &hdr, fds, b.buf) == -1) {
+        goto FAIL;
+    }
+    // end of the handoff
+    hdr = (handoff_hdr_t){.magic = HANDOFF_MAGIC};
+    if (send_chunk(sock, sendflags, &hdr, fds, NULL) == -1) {
+        goto FAIL;
+    }
+    free(b.buf);
+    lua_pushinteger(L, n);
+    return 1;
+
+FAIL:
+    free(b.buf);
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    lua_pushinteger(L, errno);
+    return 3;
+}
+
+// NOTE: the list of imported events and the list of received descriptors
+// must be placed at index 3 and 4
+static int import_records(lua_State *L, poll_t *p, handoff_hdr_t *hdr,
+                          const char *body, int nrecv, int *n)
+{
+    size_t off = 0;
+
+    for (uint32_t i = 0; i < hdr->nrec; i++) {
+        handoff_rec_t rec = {0};
+        poll_event_t *ev  = NULL;
+        uintptr_t ident   = 0;
+        int filter        = 0;
+
+        if (off + sizeof(rec) > hdr->len) {
+            goto BADMSG;
+        }
+        memcpy(&rec, body + off, sizeof(rec));
+        off += sizeof(rec);
+        if (rec.type > H_IO || off + rec.ulen > hdr->len) {
+            goto BADMSG;
+        }
+
+        switch (rec.type) {
+        case H_TIMER:
+            ident  = rec.ident;
+            filter = EVFILT_TIMER;
+            break;
+        case H_USER:
+#if defined(EVFILT_USER)
+            ident  = rec.ident;
+            filter = EVFILT_USER;
+            break;
+#else
+            errno = EOPNOTSUPP;
+            return -1;
+#endif
+        default:
+            if (rec.ident < 0 || rec.ident >= nrecv) {
+                goto BADMSG;
+            }
+            lua_rawgeti(L, 4, rec.ident + 1);
+            ident = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+            filter = (rec.type == H_WRITE) ? EVFILT_WRITE : EVFILT_READ;
+        }
+
+        ev = poll_event_new(L, p, 1);
+        EV_SET(&ev->reg_evt, ident, filter, rec.flags, rec.fflags, rec.data,
+               NULL);
+        if (rec.type == H_IO) {
+            poll_io_setup(L, ev, rec.mask);
+        }
+        ev->idle_timeout = rec.idle_timeout;
+        if (rec.utype == LUA_TSTRING || rec.utype == LUA_TNUMBER) {
+            lua_pushlstring(L, body + off, rec.ulen);
+            if (rec.utype == LUA_TNUMBER) {
+                lua_pushnumber(L, lua_tonumber(L, -1));
+                lua_replace(L, -2);
+            }
+            ev->ref_udata = getref(L);
+        }
+        off += rec.ulen;
+        luaL_getmetatable(L, HANDOFF_MT[rec.type]);
+        lua_setmetatable(L, -2);
+        lua_rawseti(L, 3, ++*n);
+    }
+    return 0;
+
+BADMSG:
+    errno = EBADMSG;
+    return -1;
+}
+
+// close the received descriptors
+static void close_received(lua_State *L, int nrecv)
+{
+    for (int i = 1; i <= nrecv; i++) {
+        lua_rawgeti(L, 4, i);
+        close(lua_tointeger(L, -1));
+        lua_pop(L, 1);
+    }
+}
+
+int poll_import_lua(lua_State *L)
+{
+    poll_t *p = luaL_checkudata(L, 1, POLL_MT);
+    int sock  = luaL_checkinteger(L, 2);
+    int n     = 0;
+    int nrecv = 0;
+    int nfail = 0;
+    int err   = 0;
+    int fds[NRECORD];
+
+    lua_settop(L, 2);
+    // list of imported events
+    lua_newtable(L);
+    // list of received descriptors
+    lua_newtable(L);
+    while (1) {
+        handoff_hdr_t hdr = {0};
+        char *body        = NULL;
+        int nfd           = recv_header(sock, &hdr, fds);
+
+        if (nfd == -1) {
+            goto FAIL;
+        } else if (hdr.nrec == 0) {
+            close_fds(fds, nfd);
+            break;
+        }
+        for (int i = 0; i < nfd; i++) {
+            lua_pushinteger(L, fds[i]);
+            lua_rawseti(L, 4, ++nrecv);
+        }
+        body = lua_newuserdata(L, hdr.len);
+        if (read_all(sock, body, hdr.len) == -1 ||
+            import_records(L, p, &hdr, body, nrecv, &n) == -1) {
+            goto FAIL;
+        }
+        lua_pop(L, 1);
+    }
+
+    // register all imported events at once
+    lua_settop(L, 3);
+    poll_watch_events(L, p, 3, n, 0, &nfail);
+    if (nfail) {
+        lua_pushstring(L, strerror(errno));
+        lua_pushinteger(L, errno);
+        return 3;
+    }
+    return 1;
+
+FAIL:
+    err = errno;
+    close_received(L, nrecv);
+    errno = err;
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    lua_pushinteger(L, errno);
+    return 3;
+}
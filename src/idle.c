@@ -0,0 +1,217 @@
+/**
+ *  Copyright (C) 2023 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "lua_kqueue.h"
+
+/**
+ * the idle timers are kept in a binary min-heap that is ordered by the
+ * deadline. the deadline of the heap entry is not updated when the event is
+ * active. it is updated lazily when the entry reaches the top of the heap, so
+ * the reset on activity costs O(1).
+ */
+
+static inline void heap_set(poll_t *p, int pos, poll_idle_t entry)
+{
+    p->idle[pos]              = entry;
+    p->idle[pos].ev->idle_idx = pos + 1;
+}
+
+static void sift_up(poll_t *p, int pos)
+{
+    poll_idle_t entry = p->idle[pos];
+
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (p->idle[parent].deadline <= entry.deadline) {
+            break;
+        }
+        heap_set(p, pos, p->idle[parent]);
+        pos = parent;
+    }
+    heap_set(p, pos, entry);
+}
+
+static void sift_down(poll_t *p, int pos)
+{
+    poll_idle_t entry = p->idle[pos];
+
+    while (1) {
+        int child = pos * 2 + 1;
+        if (child >= p->nidle) {
+            break;
+        } else if (child + 1 < p->nidle &&
+                   p->idle[child + 1].deadline < p->idle[child].deadline) {
+            child++;
+        }
+        if (entry.deadline <= p->idle[child].deadline) {
+            break;
+        }
+        heap_set(p, pos, p->idle[child]);
+        pos = child;
+    }
+    heap_set(p, pos, entry);
+}
+
+static void heap_remove(poll_t *p, int pos)
+{
+    p->idle[pos].ev->idle_idx = 0;
+    if (--p->nidle > pos) {
+        // move the last entry to the removed position
+        heap_set(p, pos, p->idle[p->nidle]);
+        sift_down(p, pos);
+        sift_up(p, p->idle[pos].ev->idle_idx - 1);
+    }
+}
+
+static void heap_push(lua_State *L, poll_t *p, poll_event_t *ev)
+{
+    if (p->nidle == p->idlesize) {
+        // grow the heap
+        int size          = p->idlesize ? p->idlesize * 2 : 16;
+        poll_idle_t *heap = lua_newuserdata(L, sizeof(poll_idle_t) * size);
+        if (p->nidle) {
+            memcpy(heap, p->idle, sizeof(poll_idle_t) * p->nidle);
+        }
+        p->ref_idle = unref(L, p->ref_idle);
+        p->ref_idle = getref(L);
+        p->idle     = heap;
+        p->idlesize = size;
+    }
+    p->idle[p->nidle] = (poll_idle_t){
+        .deadline = ev->idle_deadline,
+        .ev       = ev,
+    };
+    sift_up(p, p->nidle++);
+}
+
+static inline int in_heap(poll_event_t *ev)
+{
+    // NOTE: the event that is being moved to the other kqueue instance is not
+    // in the heap of the instance
+    return ev->idle_idx && ev->idle_idx <= ev->p->nidle &&
+           ev->p->idle[ev->idle_idx - 1].ev == ev;
+}
+
+// arm the idle timer of the watched event with the deadline
+static void idle_arm(lua_State *L, poll_event_t *ev)
+{
+    if (!in_heap(ev)) {
+        ev->idle_idx = 0;
+        heap_push(L, ev->p, ev);
+    } else if (ev->idle_deadline < ev->p->idle[ev->idle_idx - 1].deadline) {
+        // the deadline has been brought forward
+        ev->p->idle[ev->idle_idx - 1].deadline = ev->idle_deadline;
+        sift_up(ev->p, ev->idle_idx - 1);
+    }
+}
+
+void poll_idle_arm(lua_State *L, poll_event_t *ev)
+{
+    if (ev->idle_timeout > 0) {
+        ev->idle_deadline = poll_clock() + ev->idle_timeout;
+        idle_arm(L, ev);
+    }
+}
+
+void poll_idle_disarm(poll_event_t *ev)
+{
+    if (in_heap(ev)) {
+        heap_remove(ev->p, ev->idle_idx - 1);
+    }
+    ev->idle_idx = 0;
+}
+
+// NOTE: the deadline is calculated from the time of the last wait, so the
+// reset on activity does not call any system call
+void poll_idle_touch(lua_State *L, poll_event_t *ev)
+{
+    if (ev->idle_timeout > 0 && ev->enabled) {
+        ev->idle_deadline = ev->p->now + ev->idle_timeout;
+        if (!in_heap(ev)) {
+            // the idle timer has been expired
+            idle_arm(L, ev);
+        }
+    }
+}
+
+double poll_idle_next(poll_t *p)
+{
+    if (!p->nidle) {
+        return -1;
+    }
+    p->now = poll_clock();
+    if (p->idle[0].deadline <= p->now) {
+        return 0;
+    }
+    return p->idle[0].deadline - p->now;
+}
+
+int poll_idle_expire(lua_State *L, poll_t *p)
+{
+    int n = 0;
+
+    // NOTE: the time is updated at every wait since it is also used to reset
+    // the idle timers
+    p->now = poll_clock();
+    while (p->nidle && p->idle[0].deadline <= p->now) {
+        poll_event_t *ev = p->idle[0].ev;
+
+        if (ev->idle_deadline > p->now) {
+            // the event has been active since the entry was pushed
+            p->idle[0].deadline = ev->idle_deadline;
+            sift_down(p, 0);
+            continue;
+        }
+        // the idle timer is disarmed until the event becomes active again
+        heap_remove(p, 0);
+        if (poll_evset_get(L, p, &ev->reg_evt)) {
+            if (lua_touserdata(L, -1) == ev) {
+                poll_ready_push(L, p, -1, ETIMEDOUT);
+                n++;
+            }
+            lua_pop(L, 1);
+        }
+    }
+    return n;
+}
+
+int poll_event_idle_timeout_lua(lua_State *L, const char *tname)
+{
+    poll_event_t *ev = luaL_checkudata(L, 1, tname);
+
+    lua_pushnumber(L, ev->idle_timeout);
+    if (!lua_isnoneornil(L, 2)) {
+        lua_Number sec = luaL_checknumber(L, 2);
+
+        luaL_argcheck(L, sec >= 0, 2, "sec must be >= 0");
+        ev->idle_timeout = sec;
+        if (!ev->enabled) {
+            // armed when the event is watched
+        } else if (sec > 0) {
+            poll_idle_arm(L, ev);
+        } else {
+            poll_idle_disarm(ev);
+        }
+    }
+    return 1;
+}
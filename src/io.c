@@ -0,0 +1,320 @@
+/**
+ *  Copyright (C) 2023 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "lua_kqueue.h"
+
+#define MODULE_MT POLL_IO_MT
+
+#define IO_READ  0x1
+#define IO_WRITE 0x2
+
+typedef struct {
+    int mask;  // interest of the descriptor
+    int ready; // readiness of the last delivered event
+} io_t;
+
+// it returns -1 if the mask contains an invalid character
+int poll_io_parsemask(const char *str, size_t len)
+{
+    int mask = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        switch (str[i]) {
+        case 'r':
+            mask |= IO_READ;
+            break;
+        case 'w':
+            mask |= IO_WRITE;
+            break;
+        default:
+            return -1;
+        }
+    }
+    return mask;
+}
+
+static int checkmask(lua_State *L, int idx)
+{
+    size_t len      = 0;
+    const char *str = luaL_checklstring(L, idx, &len);
+    int mask        = poll_io_parsemask(str, len);
+
+    if (mask == -1) {
+        return luaL_argerror(L, idx, "mask must be 'r', 'w' or 'rw'");
+    }
+    return mask;
+}
+
+static int pushmask(lua_State *L, int mask)
+{
+    switch (mask) {
+    case IO_READ:
+        lua_pushliteral(L, "r");
+        break;
+    case IO_WRITE:
+        lua_pushliteral(L, "w");
+        break;
+    case IO_READ | IO_WRITE:
+        lua_pushliteral(L, "rw");
+        break;
+    default:
+        lua_pushliteral(L, "");
+    }
+    return 1;
+}
+
+static inline int filter_mask(int filter)
+{
+    return (filter == EVFILT_READ) ? IO_READ : IO_WRITE;
+}
+
+int poll_io_regs(poll_event_t *ev, event_t *regs)
+{
+    io_t *io = ev->ctx;
+    // NOTE: the flags of the event such as EV_CLEAR are applied to both
+    // registrations
+    int flags = ev->reg_evt.flags & ~(EV_ENABLE | EV_DISABLE);
+
+    EV_SET(&regs[0], ev->reg_evt.ident, EVFILT_READ,
+           flags | ((io->mask & IO_READ) ? EV_ENABLE : EV_DISABLE), 0, 0,
+           NULL);
+    EV_SET(&regs[1], ev->reg_evt.ident, EVFILT_WRITE,
+           flags | ((io->mask & IO_WRITE) ? EV_ENABLE : EV_DISABLE), 0, 0,
+           NULL);
+    return 2;
+}
+
+// merge the readiness of the other direction that is occurred in the same
+// batch into the delivered event
+int poll_io_handler(lua_State *L, poll_event_t *ev)
+{
+    io_t *io  = ev->ctx;
+    poll_t *p = ev->p;
+
+    (void)L;
+    io->ready = filter_mask(ev->occ_evt.filter);
+    for (int i = p->cur; i < p->nevt; i++) {
+        event_t *evt = &p->evlist[i];
+
+        if (evt->ident == ev->reg_evt.ident &&
+            (evt->filter == EVFILT_READ || evt->filter == EVFILT_WRITE) &&
+            evt->filter != ev->occ_evt.filter) {
+            io->ready |= filter_mask(evt->filter);
+            if (evt->flags & (EV_EOF | EV_ERROR)) {
+                ev->occ_evt.flags |= evt->flags & (EV_EOF | EV_ERROR);
+                ev->occ_evt.data = evt->data;
+            }
+            // remove the merged event from the event list
+            memmove(evt, evt + 1, sizeof(event_t) * (p->nevt - i - 1));
+            if (--p->nevt <= p->cur) {
+                p->nevt = 0;
+            }
+            break;
+        }
+    }
+    return POLL_OK;
+}
+
+void poll_io_setup(lua_State *L, poll_event_t *ev, int mask)
+{
+    io_t *io = poll_event_newctx(L, ev, poll_io_handler, sizeof(io_t));
+    io->mask = mask;
+}
+
+int poll_io_mask(poll_event_t *ev)
+{
+    return ((io_t *)ev->ctx)->mask;
+}
+
+static int mask_lua(lua_State *L)
+{
+    poll_event_t *ev = luaL_checkudata(L, 1, MODULE_MT);
+    io_t *io         = ev->ctx;
+    int mask         = 0;
+    event_t changes[2];
+    int nchg = 0;
+
+    if (lua_isnoneornil(L, 2)) {
+        return pushmask(L, io->mask);
+    }
+    mask = checkmask(L, 2);
+    if (ev->enabled) {
+        // apply the changes of both directions at once
+        for (int i = 0; i < 2; i++) {
+            int bit    = (i == 0) ? IO_READ : IO_WRITE;
+            int filter = (i == 0) ? EVFILT_READ : EVFILT_WRITE;
+            if ((mask & bit) != (io->mask & bit)) {
+                EV_SET(&changes[nchg++], ev->reg_evt.ident, filter,
+                       (mask & bit) ? EV_ENABLE : EV_DISABLE, 0, 0, NULL);
+            }
+        }
+        if (nchg && poll_apply_changes(ev->p->fd, changes, nchg) != 0) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(errno));
+            lua_pushinteger(L, errno);
+            return 3;
+        }
+    }
+    pushmask(L, io->mask);
+    io->mask = mask;
+    return 1;
+}
+
+static int readiness_lua(lua_State *L)
+{
+    poll_event_t *ev = luaL_checkudata(L, 1, MODULE_MT);
+    return pushmask(L, ((io_t *)ev->ctx)->ready);
+}
+
+static int mark_ready_lua(lua_State *L)
+{
+    return poll_event_mark_ready_lua(L, MODULE_MT);
+}
+
+static int idle_timeout_lua(lua_State *L)
+{
+    return poll_event_idle_timeout_lua(L, MODULE_MT);
+}
+
+static int getinfo_lua(lua_State *L)
+{
+    return poll_event_getinfo_lua(L, MODULE_MT);
+}
+
+static int udata_lua(lua_State *L)
+{
+    return poll_event_udata_lua(L, MODULE_MT);
+}
+
+static int ident_lua(lua_State *L)
+{
+    return poll_event_ident_lua(L, MODULE_MT);
+}
+
+static int is_eof_lua(lua_State *L)
+{
+    return poll_event_is_eof_lua(L, MODULE_MT);
+}
+
+static int is_enabled_lua(lua_State *L)
+{
+    return poll_event_is_enabled_lua(L, MODULE_MT);
+}
+
+static int unwatch_lua(lua_State *L)
+{
+    return poll_event_unwatch_lua(L, MODULE_MT);
+}
+
+static int watch_lua(lua_State *L)
+{
+    return poll_event_watch_lua(L, MODULE_MT);
+}
+
+static int revert_lua(lua_State *L)
+{
+    return poll_event_revert_lua(L, MODULE_MT);
+}
+
+static int type_lua(lua_State *L)
+{
+    lua_pushliteral(L, "io");
+    return 1;
+}
+
+static int tostring_lua(lua_State *L)
+{
+    return poll_event_tostring_lua(L, MODULE_MT);
+}
+
+static int gc_lua(lua_State *L)
+{
+    return poll_event_gc_lua(L);
+}
+
+int poll_io_new(lua_State *L)
+{
+    poll_event_t *ev = luaL_checkudata(L, 1, POLL_EVENT_MT);
+    int fd           = luaL_checkinteger(L, 2);
+    int mask         = checkmask(L, 3);
+
+    // keep udata reference
+    if (!lua_isnoneornil(L, 4)) {
+        ev->ref_udata = getrefat(L, 4);
+    }
+
+    poll_io_setup(L, ev, mask);
+    EV_SET(&ev->reg_evt, fd, EVFILT_READ, ev->reg_evt.flags, 0, 0, NULL);
+    if (poll_watch_event(L, ev, 1) != POLL_OK) {
+        poll_event_delctx(L, ev);
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        lua_pushinteger(L, errno);
+        return 3;
+    }
+    lua_settop(L, 1);
+    luaL_getmetatable(L, MODULE_MT);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+void libopen_poll_io(lua_State *L)
+{
+    struct luaL_Reg mmethod[] = {
+        {"__gc",       gc_lua      },
+        {"__tostring", tostring_lua},
+        {NULL,         NULL        }
+    };
+    struct luaL_Reg method[] = {
+        {"type",         type_lua        },
+        {"revert",       revert_lua      },
+        {"watch",        watch_lua       },
+        {"unwatch",      unwatch_lua     },
+        {"is_enabled",   is_enabled_lua  },
+        {"is_eof",       is_eof_lua      },
+        {"ident",        ident_lua       },
+        {"udata",        udata_lua       },
+        {"getinfo",      getinfo_lua     },
+        {"idle_timeout", idle_timeout_lua},
+        {"mark_ready",   mark_ready_lua  },
+        {"mask",         mask_lua        },
+        {"readiness",    readiness_lua   },
+        {NULL,           NULL            }
+    };
+
+    // create metatable
+    luaL_newmetatable(L, MODULE_MT);
+    // metamethods
+    for (struct luaL_Reg *ptr = mmethod; ptr->name; ptr++) {
+        lua_pushcfunction(L, ptr->func);
+        lua_setfield(L, -2, ptr->name);
+    }
+    // methods
+    lua_newtable(L);
+    for (struct luaL_Reg *ptr = method; ptr->name; ptr++) {
+        lua_pushcfunction(L, ptr->func);
+        lua_setfield(L, -2, ptr->name);
+    }
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+}
@@ -21,10 +21,68 @@
  */
 
 #include "lua_kqueue.h"
+#include <limits.h>
 
-static int check_event_status(lua_State *L, poll_event_t *ev)
+#if LUA_VERSION_NUM >= 502
+# define rawlen(L, idx) lua_rawlen(L, idx)
+#else
+# define rawlen(L, idx) lua_objlen(L, idx)
+#endif
+
+// NOTE: the event must be placed at idx
+static int check_event_status(lua_State *L, poll_event_t *ev, int idx)
 {
+    // reset the idle timer on activity
+    poll_idle_touch(L, ev);
+    if (ev->reg_evt.flags & EV_DISPATCH) {
+        // the kernel has disabled the exclusive event on delivery. it is
+        // re-enabled by the wait after the holdoff has elapsed.
+        ev->rearm_at = ev->p->now + ev->holdoff;
+        pushref(L, ev->p->ref_rearm);
+        lua_pushvalue(L, idx);
+        lua_rawseti(L, -2, ++ev->p->nrearm);
+        lua_pop(L, 1);
+    }
+    if (ev->pending == POLL_PENDING_QUEUED) {
+        // the event in the ready queue is delivered by the kernel instead
+        ev->pending = 0;
+    }
+
+    if (ev->handler) {
+        // the event handler processes the occurred event before it is
+        // delivered
+        switch (ev->handler(L, ev)) {
+        case POLL_OK:
+            if (!ev->enabled) {
+                // event has been disabled by the handler
+                return EV_ONESHOT;
+            }
+            break;
+
+        case POLL_EALREADY:
+            // event has been handled internally
+            return POLL_EALREADY;
+
+        default:
+            if (ev->enabled) {
+                int err = errno;
+                poll_unwatch_event(L, ev);
+                errno = err;
+            }
+            return POLL_ERROR;
+        }
+    }
+
     if (ev->reg_evt.flags & EV_ONESHOT) {
+        event_t regs[POLL_MAX_REGS];
+
+        if (poll_event_regs(ev, regs) > 1) {
+            // the other registrations of the event must be deleted
+            if (poll_unwatch_event(L, ev) == POLL_ERROR) {
+                return POLL_ERROR;
+            }
+            return EV_ONESHOT;
+        }
         // oneshot event must be removed from the event set table and manually
         // disable event
         poll_evset_del(L, ev);
@@ -44,17 +102,72 @@ static int check_event_status(lua_State *L, poll_event_t *ev)
     return POLL_OK;
 }
 
-static int consume_lua(lua_State *L)
+static int consume_ready(lua_State *L, poll_t *p)
+{
+    poll_event_t *ev = NULL;
+    int err          = 0;
+
+RECONSUME:
+    if (p->rhead == p->rtail) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    pushref(L, p->ref_ready);
+    p->rhead++;
+    lua_rawgeti(L, -1, p->rhead * 2 - 1);
+    lua_rawgeti(L, -2, p->rhead * 2);
+    err = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    lua_rawseti(L, -3, p->rhead * 2 - 1);
+    lua_pushnil(L);
+    lua_rawseti(L, -3, p->rhead * 2);
+    if (p->rhead == p->rtail) {
+        p->rhead = p->rtail = 0;
+    }
+    lua_replace(L, -2);
+    ev = lua_touserdata(L, -1);
+    if (ev->reg_evt.filter) {
+        if (!ev->enabled || (!err && ev->pending != POLL_PENDING_QUEUED)) {
+            // event that is registered to the kernel is already unwatched or
+            // already delivered by the kernel
+            lua_pop(L, 1);
+            goto RECONSUME;
+        } else if (!err) {
+            ev->pending = 0;
+        }
+    }
+    pushref(L, ev->ref_udata);
+
+    if (err) {
+        errno = err;
+        lua_pushboolean(L, !ev->enabled);
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        lua_pushinteger(L, errno);
+        return 6;
+    } else if (ev->occ_evt.flags & EV_EOF) {
+        lua_pushboolean(L, !ev->enabled);
+        lua_pushboolean(L, 1);
+        return 4;
+    } else if (!ev->enabled) {
+        lua_pushboolean(L, 1);
+        return 3;
+    }
+    return 2;
+}
+
+static int consume(lua_State *L, poll_t *p)
 {
-    poll_t *p   = luaL_checkudata(L, 1, POLL_MT);
     event_t evt = {0};
 
 RECONSUME:
     lua_settop(L, 1);
 
     if (p->nevt == 0) {
-        lua_pushnil(L);
-        return 1;
+        // deliver the events in the ready queue after the kernel events
+        return consume_ready(L, p);
     }
 
     evt = p->evlist[p->cur++];
@@ -74,10 +187,14 @@ RECONSUME:
     pushref(L, ev->ref_udata);
 
     // check event status
-    switch (check_event_status(L, ev)) {
+    switch (check_event_status(L, ev, 2)) {
     case POLL_OK:
         return 2;
 
+    case POLL_EALREADY:
+        // event has been handled internally
+        goto RECONSUME;
+
     case EV_ONESHOT:
         lua_pushboolean(L, 1);
         return 3;
@@ -95,6 +212,33 @@ RECONSUME:
     }
 }
 
+static int consume_lua(lua_State *L)
+{
+    poll_t *p = luaL_checkudata(L, 1, POLL_MT);
+    return consume(L, p);
+}
+
+static int consume_until_lua(lua_State *L)
+{
+    poll_t *p           = luaL_checkudata(L, 1, POLL_MT);
+    lua_Number deadline = luaL_checknumber(L, 2);
+
+    if ((p->nevt || p->rhead != p->rtail) && poll_clock() >= deadline) {
+        // keep the remaining events for the next call
+        p->deferred = p->nevt > 0;
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_settop(L, 1);
+    return consume(L, p);
+}
+
+static int clock_lua(lua_State *L)
+{
+    lua_pushnumber(L, poll_clock());
+    return 1;
+}
+
 static int cleanup_unconsumed_events(lua_State *L, poll_t *p)
 {
     while (p->cur < p->nevt) {
@@ -107,8 +251,9 @@ static int cleanup_unconsumed_events(lua_State *L, poll_t *p)
         }
         ev->occ_evt = evt;
 
-        switch (check_event_status(L, ev)) {
+        switch (check_event_status(L, ev, lua_gettop(L))) {
         case POLL_OK:
+        case POLL_EALREADY:
         case EV_ONESHOT:
         case EV_EOF:
             lua_pop(L, 1);
@@ -125,51 +270,328 @@ static int cleanup_unconsumed_events(lua_State *L, poll_t *p)
     return POLL_OK;
 }
 
+#define EVHASH(evt) ((size_t)(evt)->ident * 2654435761u ^ (size_t)(evt)->filter)
+
+// merge the events that are returned again by the kernel into the deferred
+// events at the front of the event list to avoid delivering them twice.
+// it returns the number of the remaining events of this call.
+static int merge_deferred(lua_State *L, poll_t *p, int nleft, int nevt)
+{
+    event_t *list = p->evlist + nleft;
+    size_t mask   = 1;
+    int *slots    = NULL;
+    int n         = 0;
+
+    // index the deferred events by ident and filter
+    while (mask < (size_t)nleft * 2) {
+        mask <<= 1;
+    }
+    slots = lua_newuserdata(L, sizeof(int) * mask);
+    memset(slots, 0, sizeof(int) * mask);
+    mask--;
+    for (int i = 0; i < nleft; i++) {
+        size_t h = EVHASH(&p->evlist[i]) & mask;
+        while (slots[h]) {
+            h = (h + 1) & mask;
+        }
+        slots[h] = i + 1;
+    }
+
+    for (int i = 0; i < nevt; i++) {
+        event_t *evt  = &list[i];
+        event_t *kept = NULL;
+
+        for (size_t h = EVHASH(evt) & mask; slots[h]; h = (h + 1) & mask) {
+            event_t *e = &p->evlist[slots[h] - 1];
+            if (e->ident == evt->ident && e->filter == evt->filter) {
+                kept = e;
+                break;
+            }
+        }
+        if (!kept) {
+            list[n++] = *evt;
+            continue;
+        }
+        // update the deferred event with the latest status
+        if (evt->filter == EVFILT_TIMER && !(evt->flags & EV_ERROR)) {
+            // number of expirations since the deferred event
+            evt->data += kept->data;
+        }
+        *kept = *evt;
+    }
+    lua_pop(L, 1);
+
+    return n;
+}
+
+// place the timer events that are occurred in this call before the deferred
+// events to avoid delaying them
+static void interleave_timers(lua_State *L, poll_t *p, int nleft, int nevt)
+{
+    event_t *list = p->evlist + nleft;
+    event_t *tmp  = NULL;
+    int ntimer    = 0;
+    int n         = 0;
+
+    for (int i = 0; i < nevt; i++) {
+        if (list[i].filter == EVFILT_TIMER) {
+            ntimer++;
+        }
+    }
+    if (!ntimer) {
+        return;
+    }
+
+    tmp = lua_newuserdata(L, sizeof(event_t) * (nleft + nevt));
+    for (int i = 0; i < nevt; i++) {
+        if (list[i].filter == EVFILT_TIMER) {
+            tmp[n++] = list[i];
+        }
+    }
+    memcpy(tmp + n, p->evlist, sizeof(event_t) * nleft);
+    n += nleft;
+    for (int i = 0; i < nevt; i++) {
+        if (list[i].filter != EVFILT_TIMER) {
+            tmp[n++] = list[i];
+        }
+    }
+    memcpy(p->evlist, tmp, sizeof(event_t) * n);
+    lua_pop(L, 1);
+}
+
+// call the deferred functions that are queued before this call.
+// NOTE: the functions that are deferred by them are called in the next call.
+static void run_deferred(lua_State *L, poll_t *p)
+{
+    int tail = p->dtail;
+
+    while (p->dhead < tail) {
+        int n = 0;
+
+        pushref(L, p->ref_defer);
+        lua_rawgeti(L, -1, ++p->dhead);
+        lua_pushnil(L);
+        lua_rawseti(L, -3, p->dhead);
+        lua_replace(L, -2);
+        if (p->dhead == p->dtail) {
+            p->dhead = p->dtail = 0;
+            tail                = 0;
+        }
+        // unpack the function and its arguments
+        lua_getfield(L, -1, "n");
+        n = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        luaL_checkstack(L, n + 2, "too many deferred arguments");
+        for (int i = 1; i <= n; i++) {
+            lua_rawgeti(L, -i, i);
+        }
+        lua_remove(L, -(n + 1));
+        // NOTE: the error is propagated to the caller of wait()
+        lua_call(L, n - 1, 0);
+    }
+}
+
+static int defer_lua(lua_State *L)
+{
+    poll_t *p = luaL_checkudata(L, 1, POLL_MT);
+    int narg  = lua_gettop(L) - 1;
+
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    // pack the function and its arguments
+    lua_createtable(L, narg, 1);
+    for (int i = 1; i <= narg; i++) {
+        lua_pushvalue(L, i + 1);
+        lua_rawseti(L, -2, i);
+    }
+    lua_pushinteger(L, narg);
+    lua_setfield(L, -2, "n");
+    pushref(L, p->ref_defer);
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, ++p->dtail);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// collect the changes to re-enable the exclusive events whose holdoff has
+// elapsed into the changelist that is placed on the stack top.
+// it returns the number of the changes, and sets the delay until the next
+// re-enable to next, or -1 if no event is held off.
+static int rearm_exclusive(lua_State *L, poll_t *p, event_t **changes,
+                           double *next)
+{
+    double now = poll_clock();
+    int nchg   = 0;
+    int n      = 0;
+
+    *changes = lua_newuserdata(L, sizeof(event_t) * p->nrearm);
+    *next    = -1;
+    pushref(L, p->ref_rearm);
+    for (int i = 1; i <= p->nrearm; i++) {
+        poll_event_t *ev = NULL;
+
+        lua_rawgeti(L, -1, i);
+        ev = lua_touserdata(L, -1);
+        if (!ev->enabled || ev->p != p ||
+            !(ev->reg_evt.flags & EV_DISPATCH)) {
+            // event has been unwatched, moved to another kqueue instance or
+            // is no longer exclusive
+            lua_pop(L, 1);
+        } else if (ev->rearm_at > now) {
+            // keep the event until the holdoff has elapsed
+            double delay = ev->rearm_at - now;
+            if (*next < 0 || delay < *next) {
+                *next = delay;
+            }
+            lua_rawseti(L, -2, ++n);
+        } else {
+            (*changes)[nchg]       = ev->reg_evt;
+            (*changes)[nchg].flags = EV_ENABLE | EV_DISPATCH;
+            nchg++;
+            lua_pop(L, 1);
+        }
+    }
+    for (int i = n + 1; i <= p->nrearm; i++) {
+        lua_pushnil(L);
+        lua_rawseti(L, -2, i);
+    }
+    p->nrearm = n;
+    lua_pop(L, 1);
+
+    return nchg;
+}
+
 static int wait_lua(lua_State *L)
 {
     poll_t *p      = luaL_checkudata(L, 1, POLL_MT);
     // default timeout: -1(never timeout)
     lua_Number sec = luaL_optnumber(L, 2, -1);
+    // default budget: 0(number of registered events)
+    lua_Integer maxevents = luaL_optinteger(L, 3, 0);
+    int nevents           = 0;
+    int nready            = 0;
+    int nleft             = 0;
+    event_t *changes      = NULL;
+    int nchg              = 0;
+    double rearm          = -1;
+    int holdoff           = 0;
+    double deadline       = -1;
+
+    luaL_argcheck(L, maxevents >= 0, 3, "maxevents must be >= 0");
 
-    // cleanup current events
-    if (cleanup_unconsumed_events(L, p) == POLL_ERROR) {
+    if (p->deferred && p->cur < p->nevt) {
+        // keep the events that are deferred by consume_until() at the front
+        // of the event list
+        nleft = p->nevt - p->cur;
+        memmove(p->evlist, p->evlist + p->cur, sizeof(event_t) * nleft);
+        p->cur  = 0;
+        p->nevt = nleft;
+    } else if (cleanup_unconsumed_events(L, p) == POLL_ERROR) {
+        // cleanup current events
         lua_pushnil(L);
         lua_pushstring(L, strerror(errno));
         lua_pushinteger(L, errno);
         return 3;
     }
+    p->deferred = 0;
 
-    if (p->nreg == 0) {
+    // call the deferred functions after the current events are processed
+    run_deferred(L, p);
+    // re-deliver the events that are marked as still ready
+    poll_pending_flush(L, p);
+    nready = p->rtail - p->rhead;
+
+REARM:
+    // the changes of the previous round are already applied by kevent()
+    changes = NULL;
+    nchg    = 0;
+    rearm   = -1;
+    holdoff = 0;
+    if (p->nrearm) {
+        // the exclusive events are re-enabled by this wait
+        nchg = rearm_exclusive(L, p, &changes, &rearm);
+    }
+    if (p->nreg == 0 && p->njobs == 0) {
         // do not wait the event occurrs if no registered events exists
-        lua_pushinteger(L, 0);
+        lua_pushinteger(L, nleft + nready);
         return 1;
+    } else if (nready || nleft || p->dhead != p->dtail) {
+        // do not block if the ready queue, the deferred events or the
+        // deferred functions are not empty
+        sec = 0;
+    } else {
+        // wait until the nearest idle timeout at most
+        double next = poll_idle_next(p);
+        if (next >= 0 && (sec < 0 || next < sec)) {
+            sec = next;
+        }
+        // and until the nearest re-enable of the exclusive events
+        if (rearm >= 0 && (sec < 0 || rearm < sec)) {
+            if (deadline < 0 && sec >= 0) {
+                deadline = poll_clock() + sec;
+            }
+            holdoff = 1;
+            sec     = rearm;
+        }
+    }
+
+    // NOTE: the events beyond the budget or the limit of the event list
+    // remain in the kernel queue and will be returned by the next call
+    nevents = p->nreg + p->nintern;
+    if (p->maxevlist && p->maxevlist < nevents) {
+        nevents = p->maxevlist;
+    }
+    if (maxevents && maxevents < nevents) {
+        nevents = maxevents;
     }
 
     // grow event list
-    if (p->evsize < p->nreg) {
-        p->evlist     = lua_newuserdata(L, sizeof(event_t) * p->nreg);
+    if (p->evsize < nleft + nevents) {
+        int size        = nleft + nevents;
+        event_t *evlist = lua_newuserdata(L, sizeof(event_t) * size);
+        if (nleft) {
+            memcpy(evlist, p->evlist, sizeof(event_t) * nleft);
+        }
+        p->evlist     = evlist;
         p->ref_evlist = unref(L, p->ref_evlist);
         p->ref_evlist = getref(L);
-        p->evsize     = p->nreg;
+        p->evsize     = size;
     }
 
     int nevt = 0;
     if (sec < 0) {
         // wait event forever
-        nevt = kevent(p->fd, NULL, 0, p->evlist, p->nreg, NULL);
+        nevt = kevent(p->fd, changes, nchg, p->evlist + nleft, nevents, NULL);
     } else {
         // wait event until timeout occurs
         struct timespec ts = {
             .tv_sec = sec,
         };
         ts.tv_nsec = (sec - (lua_Number)ts.tv_sec) * 1000000000,
-        nevt       = kevent(p->fd, NULL, 0, p->evlist, p->nreg, &ts);
+        nevt       = kevent(p->fd, changes, nchg, p->evlist + nleft, nevents,
+                            &ts);
     }
 
     // return number of event
     if (nevt != -1) {
-        p->nevt = nevt;
-        lua_pushinteger(L, nevt);
+        if (!nevt && holdoff) {
+            // re-enable the exclusive events and wait for the remaining time
+            sec = -1;
+            if (deadline >= 0) {
+                sec = deadline - poll_clock();
+                if (sec < 0) {
+                    sec = 0;
+                }
+            }
+            goto REARM;
+        }
+        if (nleft && nevt) {
+            nevt = merge_deferred(L, p, nleft, nevt);
+            interleave_timers(L, p, nleft, nevt);
+        }
+        p->nevt = nleft + nevt;
+        // deliver the expired idle timeouts through the ready queue
+        nready += poll_idle_expire(L, p);
+        lua_pushinteger(L, nleft + nevt + nready);
         return 1;
     }
 
@@ -179,7 +601,8 @@ static int wait_lua(lua_State *L)
     case ENOENT:
     case EINTR:
         errno = 0;
-        lua_pushinteger(L, 0);
+        nready += poll_idle_expire(L, p);
+        lua_pushinteger(L, nleft + nready);
         return 1;
 
     // return error
@@ -191,25 +614,107 @@ static int wait_lua(lua_State *L)
     }
 }
 
-static int new_event_lua(lua_State *L)
+poll_event_t *poll_event_new(lua_State *L, poll_t *p, int poll_idx)
 {
-    poll_t *p        = luaL_checkudata(L, 1, POLL_MT);
     poll_event_t *ev = lua_newuserdata(L, sizeof(poll_event_t));
 
     *ev = (poll_event_t){
         .p         = p,
-        .ref_poll  = getrefat(L, 1),
+        .ref_poll  = getrefat(L, poll_idx),
         .ref_udata = LUA_NOREF,
         .reg_evt   = (event_t){0},
         .occ_evt   = (event_t){0},
+        .ref_ctx   = LUA_NOREF,
     };
+    sigemptyset(&ev->sigset);
     // set metatable
     luaL_getmetatable(L, POLL_EVENT_MT);
     lua_setmetatable(L, -2);
 
+    return ev;
+}
+
+static int new_event_lua(lua_State *L)
+{
+    poll_t *p = luaL_checkudata(L, 1, POLL_MT);
+    poll_event_new(L, p, 1);
     return 1;
 }
 
+// register all watched events to the new kqueue descriptor at once
+static int renew_events(lua_State *L, poll_t *p)
+{
+    struct {
+        int ref;
+        int filter;
+    } evsets[] = {
+        {p->ref_evset_read,   EVFILT_READ  },
+        {p->ref_evset_write,  EVFILT_WRITE },
+        {p->ref_evset_signal, EVFILT_SIGNAL},
+        {p->ref_evset_timer,  EVFILT_TIMER },
+#if defined(EVFILT_USER)
+        {p->ref_evset_user,   EVFILT_USER  },
+#endif
+    };
+    event_t *changes = NULL;
+    int nchg         = 0;
+    int top          = lua_gettop(L);
+
+    if (p->nreg + p->nintern == 0) {
+        return POLL_OK;
+    }
+    changes = lua_newuserdata(L, sizeof(event_t) * (p->nreg + p->nintern));
+    // list of the events of each change
+    lua_createtable(L, p->nreg + p->nintern, 0);
+
+    for (size_t i = 0; i < sizeof(evsets) / sizeof(evsets[0]); i++) {
+        pushref(L, evsets[i].ref);
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+            poll_event_t *ev = lua_touserdata(L, -1);
+            uintptr_t ident  = lua_tointeger(L, -2);
+            event_t regs[POLL_MAX_REGS];
+            int nregs = poll_event_regs(ev, regs);
+
+            // NOTE: an event that has multiple registrations is placed at the
+            // ident index of each registration
+            for (int j = 0; j < nregs; j++) {
+                if (regs[j].ident == ident &&
+                    regs[j].filter == evsets[i].filter) {
+                    changes[nchg] = regs[j];
+                    changes[nchg].flags |= EV_ADD;
+                    lua_pushvalue(L, -1);
+                    lua_rawseti(L, top + 2, ++nchg);
+                    break;
+                }
+            }
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+
+    switch (poll_apply_changes(p->fd, changes, nchg)) {
+    case 0:
+        break;
+
+    case -1:
+        lua_settop(L, top);
+        return POLL_ERROR;
+
+    default:
+        // disable the events that could not be registered
+        for (int i = 0; i < nchg; i++) {
+            if (changes[i].data) {
+                lua_rawgeti(L, top + 2, i + 1);
+                poll_unwatch_event(L, lua_touserdata(L, -1));
+                lua_pop(L, 1);
+            }
+        }
+    }
+    lua_settop(L, top);
+    return POLL_OK;
+}
+
 static int renew_lua(lua_State *L)
 {
     poll_t *p = luaL_checkudata(L, 1, POLL_MT);
@@ -238,10 +743,176 @@ static int renew_lua(lua_State *L)
         p->fd = fd;
     }
 
+    if (renew_events(L, p) != POLL_OK) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, strerror(errno));
+        lua_pushinteger(L, errno);
+        return 3;
+    }
+
     lua_pushboolean(L, 1);
     return 1;
 }
 
+// NOTE: the list of events and the set of listed events must be placed at
+// index 4 and 5
+static int list_events(lua_State *L, int ref, int n)
+{
+    pushref(L, ref);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        // an event that has multiple registrations is placed at the ident
+        // index of each registration
+        lua_pushvalue(L, -1);
+        lua_rawget(L, 5);
+        if (lua_toboolean(L, -1)) {
+            lua_pop(L, 2);
+            continue;
+        }
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushboolean(L, 1);
+        lua_rawset(L, 5);
+        lua_rawseti(L, 4, ++n);
+    }
+    lua_pop(L, 1);
+    return n;
+}
+
+static int is_event(lua_State *L, int idx)
+{
+    static const char *const tnames[] = {
+        POLL_EVENT_MT, POLL_READ_MT,  POLL_WRITE_MT, POLL_SIGNAL_MT,
+        POLL_TIMER_MT, POLL_RELAY_MT, POLL_USER_MT,  POLL_IO_MT,
+        NULL,
+    };
+
+    if (lua_type(L, idx) != LUA_TUSERDATA || !lua_getmetatable(L, idx)) {
+        return 0;
+    }
+    for (const char *const *tname = tnames; *tname; tname++) {
+        luaL_getmetatable(L, *tname);
+        if (lua_rawequal(L, -1, -2)) {
+            lua_pop(L, 2);
+            return 1;
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    return 0;
+}
+
+// NOTE: names are ordered by the index of the per-filter counters
+static const char *const FILTER_NAMES[] = {
+    "read", "write", "signal", "timer", "user", NULL,
+};
+
+static int migrate_lua(lua_State *L)
+{
+    poll_t *p = luaL_checkudata(L, 1, POLL_MT);
+    int n     = 0;
+    int nfail = 0;
+
+    luaL_checkudata(L, 2, POLL_MT);
+    lua_settop(L, 3);
+    // list of events to be moved
+    lua_newtable(L);
+    // set of listed events
+    lua_newtable(L);
+
+    switch (lua_type(L, 3)) {
+    case LUA_TSTRING: {
+        int refs[] = {
+            p->ref_evset_read,  p->ref_evset_write, p->ref_evset_signal,
+            p->ref_evset_timer, p->ref_evset_user,
+        };
+        int idx = luaL_checkoption(L, 3, NULL, FILTER_NAMES);
+        n       = list_events(L, refs[idx], n);
+    } break;
+
+    case LUA_TFUNCTION: {
+        int nlist = 0;
+        nlist     = list_events(L, p->ref_evset_read, nlist);
+        nlist     = list_events(L, p->ref_evset_write, nlist);
+        nlist     = list_events(L, p->ref_evset_signal, nlist);
+        nlist     = list_events(L, p->ref_evset_timer, nlist);
+        nlist     = list_events(L, p->ref_evset_user, nlist);
+        // select the events by predicate
+        for (int i = 1; i <= nlist; i++) {
+            lua_rawgeti(L, 4, i);
+            lua_pushvalue(L, 3);
+            lua_pushvalue(L, -2);
+            pushref(L, ((poll_event_t *)lua_touserdata(L, -1))->ref_udata);
+            lua_call(L, 2, 1);
+            if (lua_toboolean(L, -1)) {
+                lua_pop(L, 1);
+                lua_rawseti(L, 4, ++n);
+            } else {
+                lua_pop(L, 2);
+            }
+        }
+    } break;
+
+    case LUA_TTABLE:
+        for (int i = 1;; i++) {
+            lua_rawgeti(L, 3, i);
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+                break;
+            } else if (!is_event(L, -1)) {
+                return luaL_argerror(L, 3, "list of events expected");
+            }
+            lua_pushvalue(L, -1);
+            lua_rawget(L, 5);
+            if (lua_toboolean(L, -1)) {
+                // already listed
+                lua_pop(L, 2);
+                continue;
+            }
+            lua_pop(L, 1);
+            lua_pushvalue(L, -1);
+            lua_pushboolean(L, 1);
+            lua_rawset(L, 5);
+            lua_rawseti(L, 4, ++n);
+        }
+        break;
+
+    default:
+        return luaL_argerror(L, 3, "string, function or table expected");
+    }
+
+    n = poll_move_events(L, p, 2, 4, n, &nfail);
+    if (n == -1) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        lua_pushinteger(L, errno);
+        return 3;
+    }
+    lua_pushinteger(L, n);
+    if (nfail) {
+        lua_pushstring(L, strerror(errno));
+        lua_pushinteger(L, errno);
+        return 3;
+    }
+    return 1;
+}
+
+static int poll_lua(lua_State *L)
+{
+    // wait events without blocking
+    lua_settop(L, 2);
+    lua_pushinteger(L, 0);
+    lua_insert(L, 2);
+    return wait_lua(L);
+}
+
+static int fd_lua(lua_State *L)
+{
+    poll_t *p = luaL_checkudata(L, 1, POLL_MT);
+    lua_pushinteger(L, p->fd);
+    return 1;
+}
+
 static int len_lua(lua_State *L)
 {
     poll_t *p = luaL_checkudata(L, 1, POLL_MT);
@@ -249,6 +920,368 @@ static int len_lua(lua_State *L)
     return 1;
 }
 
+// NOTE: the spec is the same as the arguments of the as_* methods with the
+// type name at the first element
+static void spec_event(lua_State *L, poll_t *p, int spec, int i)
+{
+    static const char *const types[] = {
+        "read", "write", "timer", "user", "io", NULL,
+    };
+    static const char *const tnames[] = {
+        POLL_READ_MT, POLL_WRITE_MT, POLL_TIMER_MT, POLL_USER_MT, POLL_IO_MT,
+    };
+    poll_event_t *ev = NULL;
+    const char *name = NULL;
+    int type         = -1;
+    int flags        = 0;
+    int udata        = 3;
+
+    lua_rawgeti(L, spec, 1);
+    name = lua_tostring(L, -1);
+    for (int j = 0; name && types[j]; j++) {
+        if (strcmp(name, types[j]) == 0) {
+            type = j;
+            break;
+        }
+    }
+    lua_pop(L, 1);
+    if (type == -1) {
+        luaL_error(L, "invalid spec #%d: unknown type", i);
+    }
+    flags = poll_checktrigger(L, spec, "trigger", flags);
+
+    ev = poll_event_new(L, p, 1);
+    lua_rawgeti(L, spec, 2);
+    switch (type) {
+    case 0:
+    case 1:
+    case 4:
+        // read, write and io
+        if (!lua_isnumber(L, -1) || lua_tointeger(L, -1) < 0) {
+            luaL_error(L, "invalid spec #%d: fd must be integer >= 0", i);
+        }
+        EV_SET(&ev->reg_evt, lua_tointeger(L, -1),
+               (type == 1) ? EVFILT_WRITE : EVFILT_READ, flags, 0, 0, NULL);
+        if (type == 4) {
+            size_t len       = 0;
+            const char *mask = NULL;
+            int m            = -1;
+
+            lua_rawgeti(L, spec, 3);
+            if ((mask = lua_tolstring(L, -1, &len))) {
+                m = poll_io_parsemask(mask, len);
+            }
+            if (m == -1) {
+                luaL_error(L, "invalid spec #%d: mask must be 'r', 'w' or 'rw'",
+                           i);
+            }
+            lua_pop(L, 1);
+            poll_io_setup(L, ev, m);
+            udata = 4;
+        }
+        break;
+
+    case 2: {
+        // timer
+        lua_Number sec = 0;
+
+        lua_rawgeti(L, spec, 3);
+        sec = lua_tonumber(L, -1);
+        if (!lua_isnumber(L, -1) || sec < 0) {
+            luaL_error(L, "invalid spec #%d: sec must be >= 0", i);
+        }
+        lua_pop(L, 1);
+        ev->autoident = lua_isnil(L, -1);
+        EV_SET(&ev->reg_evt, lua_tointeger(L, -1), EVFILT_TIMER, flags, 0,
+               (int)(sec * 1000), NULL);
+        udata = 4;
+    } break;
+
+    default:
+        // user
+#if defined(EVFILT_USER)
+        ev->autoident = lua_isnil(L, -1);
+        EV_SET(&ev->reg_evt, lua_tointeger(L, -1), EVFILT_USER,
+               flags | EV_CLEAR, NOTE_FFNOP, 0, NULL);
+#else
+        luaL_error(L, "invalid spec #%d: %s", i, strerror(EOPNOTSUPP));
+#endif
+        break;
+    }
+    lua_pop(L, 1);
+
+    // keep udata reference
+    lua_rawgeti(L, spec, udata);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+    } else {
+        ev->ref_udata = getref(L);
+    }
+    luaL_getmetatable(L, tnames[type]);
+    lua_setmetatable(L, -2);
+}
+
+static int watch_many_lua(lua_State *L)
+{
+    poll_t *p = luaL_checkudata(L, 1, POLL_MT);
+    int n     = 0;
+    int nfail = 0;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    // list of events
+    lua_newtable(L);
+    // errno of the failed events
+    lua_newtable(L);
+    for (int i = 1;; i++) {
+        lua_rawgeti(L, 2, i);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            break;
+        } else if (lua_istable(L, -1)) {
+            spec_event(L, p, lua_gettop(L), i);
+            lua_replace(L, -2);
+        } else if (!is_event(L, -1)) {
+            return luaL_argerror(L, 2, "list of events or specs expected");
+        }
+        lua_rawseti(L, 3, ++n);
+    }
+
+    poll_watch_events(L, p, 3, n, 4, &nfail);
+    if (!nfail) {
+        lua_pop(L, 1);
+        return 1;
+    }
+    return 2;
+}
+
+static int close_fd_lua(lua_State *L)
+{
+    static const int filters[] = {EVFILT_READ, EVFILT_WRITE};
+    poll_t *p                  = luaL_checkudata(L, 1, POLL_MT);
+    int fd                     = luaL_checkinteger(L, 2);
+    event_t regs[POLL_MAX_REGS];
+    event_t dels[POLL_MAX_REGS * 2];
+    int ndel = 0;
+
+    lua_settop(L, 2);
+    for (int i = 0; i < 2; i++) {
+        event_t evt      = {0};
+        poll_event_t *ev = NULL;
+
+        EV_SET(&evt, fd, filters[i], 0, 0, 0, NULL);
+        if ((ev = poll_evset_get(L, p, &evt))) {
+            lua_pop(L, 1);
+            if (ev->handler == poll_jobq_handler) {
+                // the descriptor of the job completion cannot be closed
+                errno = EPERM;
+                lua_pushboolean(L, 0);
+                lua_pushstring(L, strerror(errno));
+                lua_pushinteger(L, errno);
+                return 3;
+            }
+        }
+    }
+
+    // drop all events of the descriptor
+    for (int i = 0; i < 2; i++) {
+        event_t evt      = {0};
+        poll_event_t *ev = NULL;
+        int nregs        = 0;
+
+        EV_SET(&evt, fd, filters[i], 0, 0, 0, NULL);
+        if (!(ev = poll_evset_get(L, p, &evt))) {
+            continue;
+        }
+        // NOTE: the registrations of the descriptor are deleted by close(2),
+        // only the registrations of the other descriptors must be deleted.
+        nregs = poll_event_regs(ev, regs);
+        for (int j = 0; j < nregs; j++) {
+            if (regs[j].ident != (uintptr_t)fd) {
+                dels[ndel]       = regs[j];
+                dels[ndel].flags = EV_DELETE;
+                ndel++;
+            }
+        }
+        ev->enabled = 0;
+        poll_evset_del(L, ev);
+        // the event must not be re-delivered from the ready queue
+        poll_ready_remove(L, p, ev);
+        if (ev->handler == poll_op_handler) {
+            // the operation in progress is never completed by the kernel.
+            // deliver it as canceled in the same way as the operation that
+            // is completed without registration.
+            memset(&ev->reg_evt, 0, sizeof(event_t));
+            ev->occ_evt.flags = EV_ONESHOT;
+            poll_ready_push(L, p, -1, ECANCELED);
+        }
+        lua_pop(L, 1);
+    }
+    // NOTE: the errors of each change are ignored as poll_unwatch_event()
+    if (ndel) {
+        poll_apply_changes(p->fd, dels, ndel);
+    }
+
+    // remove the occurred events of the descriptor from the event list to
+    // avoid delivering them to the event that reuses the descriptor
+    for (int i = p->cur; i < p->nevt;) {
+        event_t *evt = &p->evlist[i];
+
+        if (evt->ident == (uintptr_t)fd &&
+            (evt->filter == EVFILT_READ || evt->filter == EVFILT_WRITE)) {
+            memmove(evt, evt + 1, sizeof(event_t) * (p->nevt - i - 1));
+            p->nevt--;
+        } else {
+            i++;
+        }
+    }
+    if (p->nevt <= p->cur) {
+        p->nevt = 0;
+    }
+
+    if (close(fd) == -1) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, strerror(errno));
+        lua_pushinteger(L, errno);
+        return 3;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int limit_lua(lua_State *L)
+{
+    poll_t *p = luaL_checkudata(L, 1, POLL_MT);
+    int maxreg[POLL_NFILTER];
+    lua_Integer maxevlist = p->maxevlist;
+
+    memcpy(maxreg, p->maxreg, sizeof(maxreg));
+    luaL_checktype(L, 2, LUA_TTABLE);
+    for (int i = 0; i < POLL_NFILTER; i++) {
+        lua_getfield(L, 2, FILTER_NAMES[i]);
+        if (!lua_isnil(L, -1)) {
+            lua_Integer v = lua_tointeger(L, -1);
+            if (lua_type(L, -1) != LUA_TNUMBER || v < 0 || v > INT_MAX) {
+                return luaL_argerror(
+                    L, 2,
+                    lua_pushfstring(L, "%s must be integer between 0 and %d",
+                                    FILTER_NAMES[i], INT_MAX));
+            }
+            maxreg[i] = v;
+        }
+        lua_pop(L, 1);
+    }
+    lua_getfield(L, 2, "evlist");
+    if (!lua_isnil(L, -1)) {
+        maxevlist = lua_tointeger(L, -1);
+        if (lua_type(L, -1) != LUA_TNUMBER || maxevlist < 0 ||
+            maxevlist > INT_MAX) {
+            return luaL_argerror(
+                L, 2,
+                lua_pushfstring(L, "evlist must be integer between 0 and %d",
+                                INT_MAX));
+        }
+    }
+    lua_pop(L, 1);
+
+    memcpy(p->maxreg, maxreg, sizeof(maxreg));
+    p->maxevlist = maxevlist;
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// estimated size of an entry of the event set table
+#define EVSET_ENTRY_SIZE (sizeof(void *) * 4)
+// estimated size of an entry of the queue tables
+#define QUEUE_ENTRY_SIZE (sizeof(void *) * 2)
+
+// size of the buffers and the data that are anchored by the context table of
+// the registered events
+static size_t ctx_size(lua_State *L, poll_t *p)
+{
+    struct {
+        int ref;
+        int filter;
+    } evsets[] = {
+        {p->ref_evset_read,   EVFILT_READ  },
+        {p->ref_evset_write,  EVFILT_WRITE },
+        {p->ref_evset_signal, EVFILT_SIGNAL},
+        {p->ref_evset_timer,  EVFILT_TIMER },
+#if defined(EVFILT_USER)
+        {p->ref_evset_user,   EVFILT_USER  },
+#endif
+    };
+    size_t size = 0;
+
+    for (size_t i = 0; i < sizeof(evsets) / sizeof(evsets[0]); i++) {
+        pushref(L, evsets[i].ref);
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+            poll_event_t *ev = lua_touserdata(L, -1);
+            event_t regs[POLL_MAX_REGS];
+
+            // NOTE: an event that has multiple registrations is counted only
+            // at the ident index of the first registration
+            if (ev->ref_ctx != LUA_NOREF && poll_event_regs(ev, regs) &&
+                regs[0].ident == (uintptr_t)lua_tointeger(L, -2) &&
+                regs[0].filter == evsets[i].filter) {
+                pushref(L, ev->ref_ctx);
+                lua_pushnil(L);
+                while (lua_next(L, -2)) {
+                    int t = lua_type(L, -1);
+                    if (t == LUA_TUSERDATA || t == LUA_TSTRING) {
+                        size += rawlen(L, -1);
+                    }
+                    lua_pop(L, 1);
+                }
+                lua_pop(L, 1);
+            }
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+    return size;
+}
+
+static int memory_lua(lua_State *L)
+{
+    poll_t *p     = luaL_checkudata(L, 1, POLL_MT);
+    size_t evlist = sizeof(event_t) * p->evsize;
+    size_t events = sizeof(poll_event_t) * p->nevent;
+    size_t evsets = EVSET_ENTRY_SIZE * p->nreg;
+    size_t ctx    = ctx_size(L, p);
+    size_t queues = QUEUE_ENTRY_SIZE *
+                    ((p->rtail - p->rhead) * 2 + p->npending +
+                     (p->dtail - p->dhead) + p->nrearm + p->njobs);
+    size_t idle   = sizeof(poll_idle_t) * p->idlesize;
+
+    lua_createtable(L, 0, 8);
+    lua_pushinteger(L, sizeof(poll_t));
+    lua_setfield(L, -2, "kqueue");
+    lua_pushinteger(L, evlist);
+    lua_setfield(L, -2, "evlist");
+    lua_pushinteger(L, events);
+    lua_setfield(L, -2, "events");
+    lua_pushinteger(L, evsets);
+    lua_setfield(L, -2, "evsets");
+    lua_pushinteger(L, ctx);
+    lua_setfield(L, -2, "ctx");
+    lua_pushinteger(L, queues);
+    lua_setfield(L, -2, "queues");
+    lua_pushinteger(L, idle);
+    lua_setfield(L, -2, "idle");
+    lua_pushinteger(L, sizeof(poll_t) + evlist + events + evsets + ctx +
+                           queues + idle);
+    lua_setfield(L, -2, "total");
+    // number of the registrations of each filter
+    lua_createtable(L, 0, POLL_NFILTER);
+    for (int i = 0; i < POLL_NFILTER; i++) {
+        lua_pushinteger(L, p->nfreg[i]);
+        lua_setfield(L, -2, FILTER_NAMES[i]);
+    }
+    return 2;
+}
+
 static int tostring_lua(lua_State *L)
 {
     lua_pushfstring(L, POLL_MT ": %p", lua_touserdata(L, 1));
@@ -264,7 +1297,19 @@ static int gc_lua(lua_State *L)
     unref(L, p->ref_evset_write);
     unref(L, p->ref_evset_signal);
     unref(L, p->ref_evset_timer);
+    unref(L, p->ref_evset_user);
+    unref(L, p->idpool[0].ref_free);
+    unref(L, p->idpool[1].ref_free);
     unref(L, p->ref_evlist);
+    unref(L, p->ref_ready);
+    unref(L, p->ref_pending);
+    unref(L, p->ref_defer);
+    unref(L, p->ref_rearm);
+    // the jobs in progress are released by the worker threads
+    poll_jobq_close(p);
+    unref(L, p->ref_jobq_event);
+    unref(L, p->ref_jobs);
+    unref(L, p->ref_idle);
 
     return 0;
 }
@@ -280,7 +1325,16 @@ static int new_lua(lua_State *L)
         .ref_evset_write  = LUA_NOREF,
         .ref_evset_signal = LUA_NOREF,
         .ref_evset_timer  = LUA_NOREF,
+        .ref_evset_user   = LUA_NOREF,
+        .idpool           = {{.ref_free = LUA_NOREF}, {.ref_free = LUA_NOREF}},
         .ref_evlist       = LUA_NOREF,
+        .ref_ready        = LUA_NOREF,
+        .ref_jobq_event   = LUA_NOREF,
+        .ref_jobs         = LUA_NOREF,
+        .ref_idle         = LUA_NOREF,
+        .ref_pending      = LUA_NOREF,
+        .ref_defer        = LUA_NOREF,
+        .ref_rearm        = LUA_NOREF,
     };
     if (p->fd == -1) {
         // got error
@@ -301,6 +1355,17 @@ static int new_lua(lua_State *L)
     p->ref_evset_signal = getref(L);
     lua_newtable(L);
     p->ref_evset_timer = getref(L);
+    lua_newtable(L);
+    p->ref_evset_user = getref(L);
+    // create ready queue
+    lua_newtable(L);
+    p->ref_ready = getref(L);
+    lua_newtable(L);
+    p->ref_pending = getref(L);
+    lua_newtable(L);
+    p->ref_defer = getref(L);
+    lua_newtable(L);
+    p->ref_rearm = getref(L);
 
     return 1;
 }
@@ -320,11 +1385,30 @@ LUALIB_API int luaopen_kqueue(lua_State *L)
         {NULL,         NULL        }
     };
     struct luaL_Reg method[] = {
-        {"renew",     renew_lua    },
-        {"new_event", new_event_lua},
-        {"wait",      wait_lua     },
-        {"consume",   consume_lua  },
-        {NULL,        NULL         }
+        {"renew",         renew_lua              },
+        {"new_event",     new_event_lua          },
+        {"wait",          wait_lua               },
+        {"poll",          poll_lua               },
+        {"fd",            fd_lua                 },
+        {"migrate",       migrate_lua            },
+        {"limit",         limit_lua              },
+        {"memory",        memory_lua             },
+        {"consume",       consume_lua            },
+        {"consume_until", consume_until_lua      },
+        {"relay",         poll_relay_new         },
+        {"submit",        poll_job_submit_lua    },
+        {"file_read",     poll_job_file_read_lua },
+        {"file_write",    poll_job_file_write_lua},
+        {"export",        poll_export_lua        },
+        {"import",        poll_import_lua        },
+        {"defer",         defer_lua              },
+        {"watch_many",    watch_many_lua         },
+        {"close_fd",      close_fd_lua           },
+        {"async_read",    poll_op_read_lua       },
+        {"async_write",   poll_op_write_lua      },
+        {"async_accept",  poll_op_accept_lua     },
+        {"async_connect", poll_op_connect_lua    },
+        {NULL,            NULL                   }
     };
 
     libopen_poll_event(L);
@@ -332,6 +1416,11 @@ LUALIB_API int luaopen_kqueue(lua_State *L)
     libopen_poll_write(L);
     libopen_poll_signal(L);
     libopen_poll_timer(L);
+    libopen_poll_relay(L);
+    libopen_poll_user(L);
+    libopen_poll_job(L);
+    libopen_poll_io(L);
+    libopen_poll_op(L);
 
     // create metatable
     luaL_newmetatable(L, POLL_MT);
@@ -355,6 +1444,14 @@ LUALIB_API int luaopen_kqueue(lua_State *L)
     lua_setfield(L, -2, "new");
     lua_pushcfunction(L, usable_lua);
     lua_setfield(L, -2, "usable");
+    lua_pushcfunction(L, poll_user_trigger_lua);
+    lua_setfield(L, -2, "trigger");
+    lua_pushcfunction(L, clock_lua);
+    lua_setfield(L, -2, "clock");
+    lua_pushcfunction(L, poll_job_pool_size_lua);
+    lua_setfield(L, -2, "pool_size");
+    lua_pushcfunction(L, poll_job_register_lua);
+    lua_setfield(L, -2, "register_job");
 
     return 1;
 }
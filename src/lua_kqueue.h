@@ -25,9 +25,13 @@
 
 #include "config.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <string.h>
 #include <sys/event.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 // lualib
 #include <lauxlib.h>
@@ -56,28 +60,168 @@ static inline void pushref(lua_State *L, int ref)
 
 typedef struct kevent event_t;
 
+// NOTE: the exclusive events cannot be used without EV_DISPATCH
+#if !defined(EV_DISPATCH)
+# define EV_DISPATCH 0
+#endif
+
+// monotonic time in seconds
+static inline double poll_clock(void)
+{
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000;
+}
+
+#if defined(HAVE_RECVMMSG) || defined(HAVE_SENDMMSG)
+typedef struct mmsghdr mmsg_t;
+#else
+typedef struct {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+} mmsg_t;
+#endif
+
+// index of the per-filter counters
+#define POLL_FREAD   0
+#define POLL_FWRITE  1
+#define POLL_FSIGNAL 2
+#define POLL_FTIMER  3
+#define POLL_FUSER   4
+#define POLL_NFILTER 5
+
+/**
+ * allocator of the idents of the timer and user events.
+ * the released idents are reused first to keep the event set table dense.
+ * the list may contain the idents that are used again by the explicit ident
+ * events, they are dropped when they are found by the allocation.
+ */
+typedef struct {
+    uintptr_t last;  // last allocated ident
+    uintptr_t *free; // list of released idents
+    int nfree;       // number of released idents
+    int size;        // capacity of the list
+    int ref_free;    // reference of the list
+} poll_idpool_t;
+
+typedef struct poll_jobq_st poll_jobq_t;
+typedef struct poll_event_st poll_event_t;
+
+// entry of the heap of the idle timers
+typedef struct {
+    double deadline;
+    poll_event_t *ev;
+} poll_idle_t;
+
 typedef struct {
     int fd;
     int ref_evset_read;
     int ref_evset_write;
     int ref_evset_signal;
     int ref_evset_timer;
+    int ref_evset_user;
     int ref_evlist;
     int nreg;
+    int nintern;              // number of registrations of the internal events
+    int nfreg[POLL_NFILTER];  // number of registrations of each filter
+    int maxreg[POLL_NFILTER]; // limit of registrations of each filter
+    int maxevlist;            // limit of the event list size
+    int nevent;               // number of registered events
+    poll_idpool_t idpool[2];  // ident allocators of the timer and user events
     int nevt;
     int cur;
     int evsize;
     event_t *evlist;
+    int deferred; // remaining events are kept by consume_until()
+    // events that are delivered by consume() after the kernel events
+    int ref_ready;
+    int rhead;
+    int rtail;
+    // events that are marked as still ready until the next wait
+    int ref_pending;
+    int npending;
+    // functions that are called before the next blocking wait
+    int ref_defer;
+    int dhead;
+    int dtail;
+    // exclusive events that are re-enabled by the next wait
+    int ref_rearm;
+    int nrearm;
+    // completion queue of the jobs that are submitted to the worker threads
+    poll_jobq_t *jobq;
+    int ref_jobq_event;
+    int ref_jobs;
+    int njobs; // number of the jobs that are not delivered yet
+    // heap of the idle timers
+    poll_idle_t *idle;
+    int nidle;
+    int idlesize;
+    int ref_idle;
+    double now; // monotonic time of the last wait
 } poll_t;
 
-typedef struct {
+/**
+ * event handler that is called before the occurred event is delivered.
+ * it returns POLL_OK to deliver the event, POLL_EALREADY if the event has been
+ * handled internally, or POLL_ERROR with errno.
+ * NOTE: the handler is also called for the event that EV_EOF or EV_ERROR is
+ * set.
+ */
+typedef int (*poll_handler_t)(lua_State *L, poll_event_t *ev);
+
+struct poll_event_st {
     poll_t *p;
     int ref_poll;
     int ref_udata;
     int enabled;
-    event_t reg_evt; // registered event
-    event_t occ_evt; // occurred event
-} poll_event_t;
+    event_t reg_evt;        // registered event
+    event_t occ_evt;        // occurred event
+    sigset_t sigset;        // signals watched by the signal event
+    int sigign;             // ignore the default action of the watched signals
+    int autoident;          // ident is allocated by the kqueue instance
+    poll_handler_t handler; // event handler
+    void *ctx;              // context of the event handler
+    int ref_ctx;            // table that anchors the context of the handler
+    double idle_timeout;    // idle timeout in seconds
+    double idle_deadline;   // deadline of the idle timeout
+    int idle_idx;           // position in the heap of the idle timers
+    int pending;            // POLL_PENDING_MARKED or POLL_PENDING_QUEUED
+    double holdoff;         // delay to re-enable the exclusive event
+    double rearm_at;        // time to re-enable the exclusive event
+    int internal;           // not counted as a registration of the instance
+};
+
+// state of the event that is marked as still ready
+#define POLL_PENDING_MARKED 1
+#define POLL_PENDING_QUEUED 2
+
+typedef struct poll_job_st poll_job_t;
+
+/**
+ * job function that is called in a worker thread.
+ * it returns 0 on success, or -1 with errno. the result can be stored in the
+ * res field as a malloc'd buffer.
+ * NOTE: the job function must not call any Lua API.
+ */
+typedef int (*poll_jobfn_t)(poll_job_t *job);
+
+struct poll_job_st {
+    poll_jobfn_t fn;
+    char *arg;      // copy of the argument
+    size_t arglen;  // length of the argument
+    char *res;      // result of the job
+    size_t reslen;  // length of the result
+    ssize_t nbyte;  // number of bytes processed by the job, or -1
+    int err;        // errno of the job
+    int fd;         // descriptor of the file job
+    off_t offset;   // offset of the file job
+    size_t len;     // length of the file job
+    poll_jobq_t *q; // completion queue of the submitting kqueue instance
+    poll_job_t *next;
+};
+
+// maximum number of the kernel registrations that an event can hold
+#define POLL_MAX_REGS NSIG
 
 #define POLL_MT        "kqueue"
 #define POLL_EVENT_MT  "kqueue.event"
@@ -85,17 +229,44 @@ typedef struct {
 #define POLL_WRITE_MT  "kqueue.write"
 #define POLL_SIGNAL_MT "kqueue.signal"
 #define POLL_TIMER_MT  "kqueue.timer"
+#define POLL_RELAY_MT  "kqueue.relay"
+#define POLL_USER_MT   "kqueue.user"
+#define POLL_JOB_MT    "kqueue.job"
+#define POLL_IO_MT     "kqueue.io"
+#define POLL_OP_MT     "kqueue.op"
 
 void libopen_poll_event(lua_State *L);
 void libopen_poll_read(lua_State *L);
 void libopen_poll_write(lua_State *L);
 void libopen_poll_signal(lua_State *L);
 void libopen_poll_timer(lua_State *L);
+void libopen_poll_relay(lua_State *L);
+void libopen_poll_user(lua_State *L);
+void libopen_poll_job(lua_State *L);
+void libopen_poll_io(lua_State *L);
+void libopen_poll_op(lua_State *L);
 
 int poll_raed_new(lua_State *L);
 int poll_write_new(lua_State *L);
 int poll_signal_new(lua_State *L);
 int poll_timer_new(lua_State *L);
+int poll_relay_new(lua_State *L);
+int poll_user_new(lua_State *L);
+int poll_io_new(lua_State *L);
+int poll_user_trigger_lua(lua_State *L);
+int poll_job_submit_lua(lua_State *L);
+int poll_job_pool_size_lua(lua_State *L);
+int poll_job_register_lua(lua_State *L);
+int poll_job_file_read_lua(lua_State *L);
+int poll_job_file_write_lua(lua_State *L);
+int poll_export_lua(lua_State *L);
+int poll_import_lua(lua_State *L);
+int poll_op_read_lua(lua_State *L);
+int poll_op_write_lua(lua_State *L);
+int poll_op_accept_lua(lua_State *L);
+int poll_op_connect_lua(lua_State *L);
+
+poll_event_t *poll_event_new(lua_State *L, poll_t *p, int poll_idx);
 
 int poll_event_gc_lua(lua_State *L);
 int poll_event_tostring_lua(lua_State *L, const char *tname);
@@ -104,16 +275,62 @@ int poll_event_revert_lua(lua_State *L, const char *tname);
 
 poll_event_t *poll_evset_get(lua_State *L, poll_t *p, event_t *evt);
 void poll_evset_del(lua_State *L, poll_event_t *ev);
+int poll_event_regs(poll_event_t *ev, event_t *regs);
+int poll_apply_changes(int fd, event_t *changes, int nchg);
+int poll_sendflags(int fd);
+ssize_t poll_writev(int fd, int sendflags, const struct iovec *iov, int iovcnt);
+
+int poll_relay_handler(lua_State *L, poll_event_t *ev);
+int poll_relay_regs(poll_event_t *ev, event_t *regs);
+int poll_io_handler(lua_State *L, poll_event_t *ev);
+int poll_io_regs(poll_event_t *ev, event_t *regs);
+void poll_io_setup(lua_State *L, poll_event_t *ev, int mask);
+int poll_io_parsemask(const char *str, size_t len);
+int poll_io_mask(poll_event_t *ev);
+int poll_op_handler(lua_State *L, poll_event_t *ev);
+int poll_accept_nonblock(int fd);
+
+int poll_job_register(const char *name, poll_jobfn_t fn);
+poll_job_t *poll_job_new(const char *arg, size_t len);
+void poll_job_free(poll_job_t *job);
+poll_event_t *poll_job_submit(lua_State *L, poll_t *p, int poll_idx,
+                              poll_job_t *job);
+int poll_jobq_handler(lua_State *L, poll_event_t *ev);
+void poll_jobq_close(poll_t *p);
+
+void poll_ready_push(lua_State *L, poll_t *p, int idx, int err);
+int poll_pending_flush(lua_State *L, poll_t *p);
+void poll_ready_remove(lua_State *L, poll_t *p, poll_event_t *ev);
+
+void poll_idle_arm(lua_State *L, poll_event_t *ev);
+void poll_idle_disarm(poll_event_t *ev);
+void poll_idle_touch(lua_State *L, poll_event_t *ev);
+double poll_idle_next(poll_t *p);
+int poll_idle_expire(lua_State *L, poll_t *p);
+
+void poll_signal_ignore(poll_event_t *ev);
+void poll_signal_restore(poll_event_t *ev);
 
 #define POLL_ERROR    -1
 #define POLL_OK       0
 #define POLL_EALREADY 1
 
+void *poll_event_newctx(lua_State *L, poll_event_t *ev, poll_handler_t handler,
+                        size_t size);
+void poll_event_delctx(lua_State *L, poll_event_t *ev);
+
 int poll_watch_event(lua_State *L, poll_event_t *ev, int poll_event_idx);
+int poll_watch_events(lua_State *L, poll_t *p, int list, int n, int errs,
+                      int *nfail);
 int poll_unwatch_event(lua_State *L, poll_event_t *ev);
+int poll_move_events(lua_State *L, poll_t *src, int dst_idx, int list, int n,
+                     int *nfail);
+int poll_modify_event(lua_State *L, poll_event_t *ev, event_t evt);
+int poll_checktrigger(lua_State *L, int idx, const char *field, int flags);
 
 int poll_event_watch_lua(lua_State *L, const char *tname);
 int poll_event_unwatch_lua(lua_State *L, const char *tname);
+int poll_event_modify_lua(lua_State *L, const char *tname);
 
 int poll_event_is_enabled_lua(lua_State *L, const char *tname);
 int poll_event_is_eof_lua(lua_State *L, const char *tname);
@@ -126,5 +343,7 @@ int poll_event_as_oneshot_lua(lua_State *L, const char *tname);
 int poll_event_ident_lua(lua_State *L, const char *tname);
 int poll_event_udata_lua(lua_State *L, const char *tname);
 int poll_event_getinfo_lua(lua_State *L, const char *tname);
+int poll_event_idle_timeout_lua(lua_State *L, const char *tname);
+int poll_event_mark_ready_lua(lua_State *L, const char *tname);
 
 #endif
@@ -0,0 +1,360 @@
+/**
+ *  Copyright (C) 2023 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "lua_kqueue.h"
+
+#define MODULE_MT POLL_OP_MT
+
+enum {
+    OP_READ,
+    OP_WRITE,
+    OP_ACCEPT,
+    OP_CONNECT,
+};
+
+typedef struct {
+    int kind;
+    int fd;
+    char *buf;        // buffer to read
+    const char *data; // data to write, anchored by the context table
+    size_t len;       // size of the buffer or length of the data
+    size_t nbyte;     // number of bytes written
+    int sendflags;    // flags of sendmsg, or -1 if fd is not a socket
+    int sock;         // accepted descriptor that is not retrieved yet
+} op_t;
+
+static void setresult(lua_State *L, poll_event_t *ev)
+{
+    pushref(L, ev->ref_ctx);
+    lua_insert(L, -2);
+    lua_setfield(L, -2, "result");
+    lua_pop(L, 1);
+}
+
+static int is_again(void)
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+// perform the operation and store its result. it returns POLL_EALREADY if
+// the operation would block.
+static int perform(lua_State *L, poll_event_t *ev)
+{
+    op_t *op = ev->ctx;
+
+    switch (op->kind) {
+    case OP_READ: {
+        ssize_t n = read(op->fd, op->buf, op->len);
+
+        if (n == -1) {
+            return is_again() ? POLL_EALREADY : POLL_ERROR;
+        } else if (n == 0) {
+            ev->occ_evt.flags |= EV_EOF;
+        }
+        lua_pushlstring(L, op->buf, n);
+    } break;
+
+    case OP_WRITE:
+        while (op->nbyte < op->len) {
+            struct iovec iov = {
+                .iov_base = (void *)(op->data + op->nbyte),
+                .iov_len  = op->len - op->nbyte,
+            };
+            // NOTE: the write to the socket that the peer has closed must not
+            // raise SIGPIPE
+            ssize_t n = poll_writev(op->fd, op->sendflags, &iov, 1);
+            if (n >= 0) {
+                op->nbyte += n;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return POLL_EALREADY;
+            } else {
+                // report the bytes written before the error
+                int err = errno;
+                lua_pushinteger(L, op->nbyte);
+                setresult(L, ev);
+                errno = err;
+                return POLL_ERROR;
+            }
+        }
+        lua_pushinteger(L, op->nbyte);
+        break;
+
+    case OP_ACCEPT: {
+        int sock = poll_accept_nonblock(op->fd);
+
+        if (sock == -1) {
+            return (is_again() || errno == ECONNABORTED) ? POLL_EALREADY :
+                                                           POLL_ERROR;
+        }
+        // the accepted descriptor is closed by gc unless it is retrieved by
+        // op:result()
+        op->sock = sock;
+        lua_pushinteger(L, sock);
+    } break;
+
+    default: {
+        // the result of the connection in progress
+        int err       = 0;
+        socklen_t len = sizeof(int);
+
+        if (getsockopt(op->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+            return POLL_ERROR;
+        } else if (err) {
+            errno = err;
+            return POLL_ERROR;
+        }
+        lua_pushboolean(L, 1);
+    } break;
+    }
+
+    setresult(L, ev);
+    return POLL_OK;
+}
+
+// perform the operation on readiness, and deliver only its completion
+int poll_op_handler(lua_State *L, poll_event_t *ev)
+{
+    int rv = POLL_ERROR;
+
+    if (ev->occ_evt.flags & EV_ERROR) {
+        errno = ev->occ_evt.data;
+    } else {
+        // NOTE: EV_EOF is set only if the read operation reached the end of
+        // file, the other operations report the error of the descriptor.
+        ev->occ_evt.flags &= ~EV_EOF;
+        rv = perform(L, ev);
+    }
+
+    switch (rv) {
+    case POLL_OK:
+        return POLL_OK;
+
+    case POLL_EALREADY: {
+        // re-arm the oneshot registration and wait for the next readiness
+        event_t evt = ev->reg_evt;
+
+        evt.flags |= EV_ADD;
+        if (poll_apply_changes(ev->p->fd, &evt, 1) == 0) {
+            return POLL_EALREADY;
+        }
+    }
+        // fallthrough
+
+    default: {
+        // the oneshot registration is already deleted by the kernel
+        int err     = errno;
+        ev->enabled = 0;
+        poll_evset_del(L, ev);
+        errno = err;
+        return POLL_ERROR;
+    }
+    }
+}
+
+static int submit_op(lua_State *L, int kind, int fd, size_t len, int udata)
+{
+    poll_t *p        = luaL_checkudata(L, 1, POLL_MT);
+    poll_event_t *ev = NULL;
+    op_t *op         = NULL;
+
+    luaL_argcheck(L, fd >= 0, 2, "fd must be >= 0");
+    lua_settop(L, udata);
+    ev = poll_event_new(L, p, 1);
+    op = poll_event_newctx(L, ev, poll_op_handler,
+                           sizeof(op_t) + ((kind == OP_READ) ? len : 0));
+    op->kind = kind;
+    op->fd   = fd;
+    op->len  = len;
+    op->sock = -1;
+    if (kind == OP_READ) {
+        op->buf = (char *)(op + 1);
+    } else if (kind == OP_WRITE) {
+        // keep the data until the operation is completed
+        pushref(L, ev->ref_ctx);
+        lua_pushvalue(L, 3);
+        lua_setfield(L, -2, "data");
+        lua_pop(L, 1);
+        op->data      = lua_tostring(L, 3);
+        op->sendflags = poll_sendflags(fd);
+    }
+    // keep udata reference
+    if (!lua_isnil(L, udata)) {
+        ev->ref_udata = getrefat(L, udata);
+    }
+    luaL_getmetatable(L, MODULE_MT);
+    lua_setmetatable(L, -2);
+
+    // NOTE: the connection in progress cannot be completed without waiting
+    // for the writability
+    if (kind != OP_CONNECT) {
+        // try the operation before registering it to the kernel, and deliver
+        // the completion through the ready queue
+        int rv = perform(L, ev);
+        if (rv != POLL_EALREADY) {
+            ev->occ_evt.flags |= EV_ONESHOT;
+            poll_ready_push(L, p, -1, (rv == POLL_OK) ? 0 : errno);
+            return 1;
+        }
+    }
+
+    EV_SET(&ev->reg_evt, fd,
+           (kind == OP_READ || kind == OP_ACCEPT) ? EVFILT_READ : EVFILT_WRITE,
+           EV_ONESHOT, 0, 0, NULL);
+    if (poll_watch_event(L, ev, lua_gettop(L)) != POLL_OK) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        lua_pushinteger(L, errno);
+        return 3;
+    }
+    return 1;
+}
+
+int poll_op_read_lua(lua_State *L)
+{
+    int fd          = luaL_checkinteger(L, 2);
+    lua_Integer len = luaL_checkinteger(L, 3);
+
+    luaL_argcheck(L, len > 0, 3, "len must be > 0");
+    return submit_op(L, OP_READ, fd, len, 4);
+}
+
+int poll_op_write_lua(lua_State *L)
+{
+    int fd     = luaL_checkinteger(L, 2);
+    size_t len = 0;
+
+    luaL_checklstring(L, 3, &len);
+    return submit_op(L, OP_WRITE, fd, len, 4);
+}
+
+int poll_op_accept_lua(lua_State *L)
+{
+    return submit_op(L, OP_ACCEPT, luaL_checkinteger(L, 2), 0, 3);
+}
+
+int poll_op_connect_lua(lua_State *L)
+{
+    return submit_op(L, OP_CONNECT, luaL_checkinteger(L, 2), 0, 3);
+}
+
+static int cancel_lua(lua_State *L)
+{
+    poll_event_t *ev = luaL_checkudata(L, 1, MODULE_MT);
+
+    switch (poll_unwatch_event(L, ev)) {
+    case POLL_OK:
+        lua_pushboolean(L, 1);
+        return 1;
+
+    case POLL_EALREADY:
+        // already completed
+        lua_pushboolean(L, 0);
+        return 1;
+
+    default:
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, strerror(errno));
+        lua_pushinteger(L, errno);
+        return 3;
+    }
+}
+
+static int result_lua(lua_State *L)
+{
+    poll_event_t *ev = luaL_checkudata(L, 1, MODULE_MT);
+    op_t *op         = ev->ctx;
+
+    // the caller owns the accepted descriptor
+    op->sock = -1;
+    pushref(L, ev->ref_ctx);
+    lua_getfield(L, -1, "result");
+    return 1;
+}
+
+static int is_enabled_lua(lua_State *L)
+{
+    return poll_event_is_enabled_lua(L, MODULE_MT);
+}
+
+static int udata_lua(lua_State *L)
+{
+    return poll_event_udata_lua(L, MODULE_MT);
+}
+
+static int type_lua(lua_State *L)
+{
+    lua_pushliteral(L, "op");
+    return 1;
+}
+
+static int tostring_lua(lua_State *L)
+{
+    return poll_event_tostring_lua(L, MODULE_MT);
+}
+
+static int gc_lua(lua_State *L)
+{
+    poll_event_t *ev = lua_touserdata(L, 1);
+    op_t *op         = ev->ctx;
+
+    if (op && op->sock != -1) {
+        // close the accepted descriptor that is never retrieved
+        close(op->sock);
+    }
+    return poll_event_gc_lua(L);
+}
+
+void libopen_poll_op(lua_State *L)
+{
+    struct luaL_Reg mmethod[] = {
+        {"__gc",       gc_lua      },
+        {"__tostring", tostring_lua},
+        {NULL,         NULL        }
+    };
+    struct luaL_Reg method[] = {
+        {"type",       type_lua      },
+        {"is_enabled", is_enabled_lua},
+        {"udata",      udata_lua     },
+        {"result",     result_lua    },
+        {"cancel",     cancel_lua    },
+        {NULL,         NULL          }
+    };
+
+    // create metatable
+    luaL_newmetatable(L, MODULE_MT);
+    // metamethods
+    for (struct luaL_Reg *ptr = mmethod; ptr->name; ptr++) {
+        lua_pushcfunction(L, ptr->func);
+        lua_setfield(L, -2, ptr->name);
+    }
+    // methods
+    lua_newtable(L);
+    for (struct luaL_Reg *ptr = method; ptr->name; ptr++) {
+        lua_pushcfunction(L, ptr->func);
+        lua_setfield(L, -2, ptr->name);
+    }
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+}
@@ -0,0 +1,782 @@
+/**
+ *  Copyright (C) 2023 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "lua_kqueue.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MODULE_MT POLL_JOB_MT
+
+// maximum number of the worker threads
+#define POOL_MAX_THREADS 64
+// maximum number of the jobs that can be submitted by name
+#define POOL_MAX_JOBS 64
+
+/**
+ * completion queue of a kqueue instance.
+ * the worker threads append the completed jobs to the queue and wake up the
+ * kqueue instance through the pipe. the pipe is written only if the queue is
+ * not signalled, so the jobs that are completed before the kqueue instance
+ * consumes the queue cost a single wakeup.
+ */
+struct poll_jobq_st {
+    pthread_mutex_t mutex;
+    int refcnt;    // kqueue instance and the jobs in progress
+    int fd[2];     // pipe to wake up the kqueue instance
+    int signalled; // pipe has been written
+    poll_job_t *head;
+    poll_job_t *tail;
+    // list of the completion queues that are alive
+    poll_jobq_t *prev;
+    poll_jobq_t *next;
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_once_t once;
+    int maxthread;
+    int nthread;
+    int nidle;
+    poll_job_t *head;
+    poll_job_t *tail;
+    poll_jobq_t *jobqs;
+} POOL = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond  = PTHREAD_COND_INITIALIZER,
+    .once  = PTHREAD_ONCE_INIT,
+};
+
+static int job_sleep(poll_job_t *job);
+
+/**
+ * jobs that can be submitted by name.
+ * the other C modules can add their jobs by poll_job_register().
+ */
+static struct {
+    pthread_mutex_t mutex;
+    int njob;
+    struct {
+        char name[64];
+        poll_jobfn_t fn;
+    } list[POOL_MAX_JOBS];
+} JOBS = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .njob  = 1,
+    .list  = {
+        {"sleep", job_sleep},
+    },
+};
+
+static void pool_atfork_prepare(void)
+{
+    // keep the list of the completion queues consistent across fork
+    pthread_mutex_lock(&POOL.mutex);
+}
+
+static void pool_atfork_parent(void)
+{
+    pthread_mutex_unlock(&POOL.mutex);
+}
+
+static void pool_atfork_child(void)
+{
+    // the worker threads do not exist in the child process.
+    // NOTE: the jobs in progress are never completed in the child process.
+    pthread_mutex_init(&POOL.mutex, NULL);
+    pthread_cond_init(&POOL.cond, NULL);
+    POOL.nthread = 0;
+    POOL.nidle   = 0;
+    POOL.head    = NULL;
+    POOL.tail    = NULL;
+    // the mutexes may have been held by the threads that do not exist
+    for (poll_jobq_t *q = POOL.jobqs; q; q = q->next) {
+        pthread_mutex_init(&q->mutex, NULL);
+    }
+    pthread_mutex_init(&JOBS.mutex, NULL);
+}
+
+static void pool_init(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1) {
+        n = 1;
+    } else if (n > POOL_MAX_THREADS) {
+        n = POOL_MAX_THREADS;
+    }
+    if (!POOL.maxthread) {
+        POOL.maxthread = n;
+    }
+    pthread_atfork(pool_atfork_prepare, pool_atfork_parent,
+                   pool_atfork_child);
+}
+
+static void jobq_unref(poll_jobq_t *q)
+{
+    int refcnt = 0;
+
+    pthread_mutex_lock(&q->mutex);
+    refcnt = --q->refcnt;
+    pthread_mutex_unlock(&q->mutex);
+    if (refcnt == 0) {
+        pthread_mutex_lock(&POOL.mutex);
+        if (q->prev) {
+            q->prev->next = q->next;
+        } else {
+            POOL.jobqs = q->next;
+        }
+        if (q->next) {
+            q->next->prev = q->prev;
+        }
+        pthread_mutex_unlock(&POOL.mutex);
+        pthread_mutex_destroy(&q->mutex);
+        free(q);
+    }
+}
+
+static void jobq_complete(poll_job_t *job)
+{
+    poll_jobq_t *q = job->q;
+
+    pthread_mutex_lock(&q->mutex);
+    if (q->fd[1] == -1) {
+        // kqueue instance has been closed
+        pthread_mutex_unlock(&q->mutex);
+        poll_job_free(job);
+        return;
+    }
+    job->next = NULL;
+    if (q->tail) {
+        q->tail->next = job;
+    } else {
+        q->head = job;
+    }
+    q->tail = job;
+    if (!q->signalled) {
+        // NOTE: EAGAIN can be ignored because the pipe is readable
+        q->signalled = write(q->fd[1], "", 1) == 1 || errno == EAGAIN;
+    }
+    pthread_mutex_unlock(&q->mutex);
+}
+
+static void *pool_worker(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&POOL.mutex);
+    while (1) {
+        poll_job_t *job = POOL.head;
+
+        if (!job) {
+            POOL.nidle++;
+            pthread_cond_wait(&POOL.cond, &POOL.mutex);
+            POOL.nidle--;
+            continue;
+        }
+        POOL.head = job->next;
+        if (!POOL.head) {
+            POOL.tail = NULL;
+        }
+        pthread_mutex_unlock(&POOL.mutex);
+
+        errno    = 0;
+        job->err = job->fn(job) == 0 ? 0 : errno;
+        jobq_complete(job);
+
+        pthread_mutex_lock(&POOL.mutex);
+    }
+    return NULL;
+}
+
+static int pool_push(poll_job_t *job)
+{
+    int rc = 0;
+
+    pthread_once(&POOL.once, pool_init);
+    pthread_mutex_lock(&POOL.mutex);
+    if (POOL.nidle == 0 && POOL.nthread < POOL.maxthread) {
+        // start a new worker thread if all threads are busy
+        pthread_attr_t attr;
+        pthread_t tid;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        rc = pthread_create(&tid, &attr, pool_worker, NULL);
+        pthread_attr_destroy(&attr);
+        if (rc == 0) {
+            POOL.nthread++;
+        } else if (POOL.nthread == 0) {
+            // no worker thread exists
+            pthread_mutex_unlock(&POOL.mutex);
+            errno = rc;
+            return -1;
+        }
+    }
+    job->next = NULL;
+    if (POOL.tail) {
+        POOL.tail->next = job;
+    } else {
+        POOL.head = job;
+    }
+    POOL.tail = job;
+    pthread_cond_signal(&POOL.cond);
+    pthread_mutex_unlock(&POOL.mutex);
+
+    return 0;
+}
+
+int poll_job_pool_size_lua(lua_State *L)
+{
+    lua_Integer n = luaL_optinteger(L, 1, 0);
+
+    luaL_argcheck(L, n >= 0 && n <= POOL_MAX_THREADS, 1,
+                  "size must be between 0 and 64");
+    pthread_once(&POOL.once, pool_init);
+    pthread_mutex_lock(&POOL.mutex);
+    lua_pushinteger(L, POOL.maxthread);
+    if (n) {
+        // NOTE: the running worker threads are not stopped
+        POOL.maxthread = n;
+    }
+    pthread_mutex_unlock(&POOL.mutex);
+    return 1;
+}
+
+poll_job_t *poll_job_new(const char *arg, size_t len)
+{
+    poll_job_t *job = calloc(1, sizeof(poll_job_t) + len + 1);
+
+    if (job) {
+        job->arg    = (char *)(job + 1);
+        job->arglen = len;
+        job->nbyte  = -1;
+        job->fd     = -1;
+        if (len) {
+            memcpy(job->arg, arg, len);
+        }
+    }
+    return job;
+}
+
+void poll_job_free(poll_job_t *job)
+{
+    poll_jobq_t *q = job->q;
+
+    free(job->res);
+    free(job);
+    if (q) {
+        jobq_unref(q);
+    }
+}
+
+int poll_jobq_handler(lua_State *L, poll_event_t *ev)
+{
+    poll_t *p      = ev->p;
+    poll_jobq_t *q = p->jobq;
+    poll_job_t *job = NULL;
+    char buf[64];
+
+    // drain the pipe before the queue is taken
+    while (read(q->fd[0], buf, sizeof(buf)) > 0) {
+    }
+    pthread_mutex_lock(&q->mutex);
+    job          = q->head;
+    q->head      = NULL;
+    q->tail      = NULL;
+    q->signalled = 0;
+    pthread_mutex_unlock(&q->mutex);
+
+    pushref(L, p->ref_jobs);
+    while (job) {
+        poll_job_t *next  = job->next;
+        poll_event_t *jev = NULL;
+
+        lua_pushlightuserdata(L, job);
+        lua_rawget(L, -2);
+        jev = lua_touserdata(L, -1);
+        if (!jev) {
+            lua_pop(L, 1);
+            poll_job_free(job);
+            job = next;
+            continue;
+        }
+        // release the job from the job table
+        lua_pushlightuserdata(L, job);
+        lua_pushnil(L);
+        lua_rawset(L, -4);
+        p->njobs--;
+
+        jev->enabled = 0;
+        EV_SET(&jev->occ_evt, 0, 0, EV_ONESHOT, 0, 0, NULL);
+        if (!job->err && (job->res || job->nbyte >= 0)) {
+            pushref(L, jev->ref_ctx);
+            if (job->res) {
+                lua_pushlstring(L, job->res, job->reslen);
+            } else {
+                lua_pushinteger(L, job->nbyte);
+            }
+            lua_setfield(L, -2, "result");
+            lua_pop(L, 1);
+        }
+        poll_ready_push(L, p, -1, job->err);
+        lua_pop(L, 1);
+        poll_job_free(job);
+        job = next;
+    }
+    lua_pop(L, 1);
+
+    return POLL_EALREADY;
+}
+
+static poll_jobq_t *jobq_open(lua_State *L, poll_t *p, int poll_idx)
+{
+    poll_jobq_t *q   = NULL;
+    poll_event_t *ev = NULL;
+    int fd[2];
+
+    if (p->jobq) {
+        return p->jobq;
+    } else if (pipe(fd) != 0) {
+        return NULL;
+    }
+    for (int i = 0; i < 2; i++) {
+        int flg = fcntl(fd[i], F_GETFL);
+        if (flg == -1 || fcntl(fd[i], F_SETFL, flg | O_NONBLOCK) == -1 ||
+            fcntl(fd[i], F_SETFD, FD_CLOEXEC) == -1) {
+            int err = errno;
+            close(fd[0]);
+            close(fd[1]);
+            errno = err;
+            return NULL;
+        }
+    }
+    if (!(q = calloc(1, sizeof(poll_jobq_t)))) {
+        close(fd[0]);
+        close(fd[1]);
+        return NULL;
+    }
+    pthread_mutex_init(&q->mutex, NULL);
+    q->refcnt = 1;
+    q->fd[0]  = fd[0];
+    q->fd[1]  = fd[1];
+    p->jobq   = q;
+    pthread_once(&POOL.once, pool_init);
+    pthread_mutex_lock(&POOL.mutex);
+    q->next = POOL.jobqs;
+    if (q->next) {
+        q->next->prev = q;
+    }
+    POOL.jobqs = q;
+    pthread_mutex_unlock(&POOL.mutex);
+
+    // watch the read end of the pipe internally.
+    // NOTE: the internal event is not counted as a registration of the
+    // kqueue instance, and is not limited by kq:limit().
+    ev = poll_event_new(L, p, poll_idx);
+    EV_SET(&ev->reg_evt, fd[0], EVFILT_READ, 0, 0, 0, NULL);
+    ev->handler  = poll_jobq_handler;
+    ev->internal = 1;
+    if (poll_watch_event(L, ev, lua_gettop(L)) != POLL_OK) {
+        int err = errno;
+        lua_pop(L, 1);
+        poll_jobq_close(p);
+        errno = err;
+        return NULL;
+    }
+    // NOTE: the internal event does not anchor the kqueue instance to allow
+    // it to be collected
+    ev->ref_poll      = unref(L, ev->ref_poll);
+    p->ref_jobq_event = getref(L);
+    lua_newtable(L);
+    p->ref_jobs = getref(L);
+
+    return q;
+}
+
+void poll_jobq_close(poll_t *p)
+{
+    poll_jobq_t *q  = p->jobq;
+    poll_job_t *job = NULL;
+
+    if (!q) {
+        return;
+    }
+    p->jobq = NULL;
+    pthread_mutex_lock(&q->mutex);
+    close(q->fd[0]);
+    close(q->fd[1]);
+    q->fd[0] = q->fd[1] = -1;
+    job                 = q->head;
+    q->head = q->tail = NULL;
+    pthread_mutex_unlock(&q->mutex);
+    // release the completed jobs that have not been delivered
+    while (job) {
+        poll_job_t *next = job->next;
+        poll_job_free(job);
+        job = next;
+    }
+    jobq_unref(q);
+}
+
+poll_event_t *poll_job_submit(lua_State *L, poll_t *p, int poll_idx,
+                              poll_job_t *job)
+{
+    poll_jobq_t *q   = jobq_open(L, p, poll_idx);
+    poll_event_t *ev = NULL;
+
+    if (!q) {
+        return NULL;
+    }
+    ev = poll_event_new(L, p, poll_idx);
+    // NOTE: the job event does not anchor the kqueue instance because it is
+    // anchored by the job table of the kqueue instance until it is completed
+    ev->ref_poll = unref(L, ev->ref_poll);
+    // create a table that holds the result of the job
+    lua_newtable(L);
+    ev->ref_ctx = getref(L);
+
+    pthread_mutex_lock(&q->mutex);
+    q->refcnt++;
+    pthread_mutex_unlock(&q->mutex);
+    job->q = q;
+    if (pool_push(job) != 0) {
+        job->q = NULL;
+        jobq_unref(q);
+        lua_pop(L, 1);
+        return NULL;
+    }
+    ev->enabled = 1;
+    luaL_getmetatable(L, MODULE_MT);
+    lua_setmetatable(L, -2);
+    // anchor the job event until the job is completed
+    pushref(L, p->ref_jobs);
+    lua_pushlightuserdata(L, job);
+    lua_pushvalue(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    p->njobs++;
+
+    return ev;
+}
+
+static int job_sleep(poll_job_t *job)
+{
+    double sec         = strtod(job->arg, NULL);
+    struct timespec ts = {0};
+
+    if (sec < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    ts.tv_sec  = (time_t)sec;
+    ts.tv_nsec = (long)((sec - (double)ts.tv_sec) * 1000000000);
+    while (nanosleep(&ts, &ts) != 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int job_pread(poll_job_t *job)
+{
+    char *buf = malloc(job->len ? job->len : 1);
+    size_t n  = 0;
+
+    if (!buf) {
+        return -1;
+    }
+    // read until the length is filled or the end of file
+    while (n < job->len) {
+        ssize_t rv = pread(job->fd, buf + n, job->len - n, job->offset + n);
+        if (rv > 0) {
+            n += rv;
+        } else if (rv == 0) {
+            break;
+        } else if (errno != EINTR) {
+            free(buf);
+            return -1;
+        }
+    }
+    job->res    = buf;
+    job->reslen = n;
+    job->nbyte  = n;
+    return 0;
+}
+
+static int job_pwrite(poll_job_t *job)
+{
+    size_t n = 0;
+
+    while (n < job->arglen) {
+        ssize_t rv = pwrite(job->fd, job->arg + n, job->arglen - n,
+                            job->offset + n);
+        if (rv >= 0) {
+            n += rv;
+        } else if (errno != EINTR) {
+            if (n) {
+                // report the bytes written before the error
+                break;
+            }
+            return -1;
+        }
+    }
+    job->nbyte = n;
+    return 0;
+}
+
+static int submit_file_job(lua_State *L, poll_jobfn_t fn, const char *data,
+                           size_t datalen, size_t len)
+{
+    poll_t *p         = luaL_checkudata(L, 1, POLL_MT);
+    int fd            = luaL_checkinteger(L, 2);
+    lua_Integer off   = luaL_checkinteger(L, 3);
+    poll_job_t *job   = NULL;
+    poll_event_t *jev = NULL;
+
+    luaL_argcheck(L, fd >= 0, 2, "fd must be >= 0");
+    luaL_argcheck(L, off >= 0, 3, "offset must be >= 0");
+
+    if (!(job = poll_job_new(data, datalen))) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        lua_pushinteger(L, errno);
+        return 3;
+    }
+    job->fn     = fn;
+    job->fd     = fd;
+    job->offset = off;
+    job->len    = len;
+    if (!(jev = poll_job_submit(L, p, 1, job))) {
+        int err = errno;
+        poll_job_free(job);
+        errno = err;
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        lua_pushinteger(L, errno);
+        return 3;
+    }
+    // keep udata reference
+    if (!lua_isnil(L, 5)) {
+        jev->ref_udata = getrefat(L, 5);
+    }
+    return 1;
+}
+
+int poll_job_file_read_lua(lua_State *L)
+{
+    lua_Integer len = luaL_checkinteger(L, 4);
+
+    luaL_argcheck(L, len >= 0, 4, "len must be >= 0");
+    lua_settop(L, 5);
+    return submit_file_job(L, job_pread, NULL, 0, len);
+}
+
+int poll_job_file_write_lua(lua_State *L)
+{
+    size_t len       = 0;
+    const char *data = luaL_checklstring(L, 4, &len);
+
+    lua_settop(L, 5);
+    return submit_file_job(L, job_pwrite, data, len, len);
+}
+
+int poll_job_register(const char *name, poll_jobfn_t fn)
+{
+    int rc = 0;
+
+    if (!name || !fn || strlen(name) >= sizeof(JOBS.list[0].name)) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&JOBS.mutex);
+    for (int i = 0; i < JOBS.njob; i++) {
+        if (strcmp(JOBS.list[i].name, name) == 0) {
+            // NOTE: the job function that is already registered cannot be
+            // replaced because the submitted jobs may refer to it
+            errno = EEXIST;
+            rc    = -1;
+            break;
+        }
+    }
+    if (rc == 0 && JOBS.njob == POOL_MAX_JOBS) {
+        errno = ENOBUFS;
+        rc    = -1;
+    } else if (rc == 0) {
+        strcpy(JOBS.list[JOBS.njob].name, name);
+        JOBS.list[JOBS.njob].fn = fn;
+        JOBS.njob++;
+    }
+    pthread_mutex_unlock(&JOBS.mutex);
+
+    return rc;
+}
+
+int poll_job_register_lua(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    poll_jobfn_t fn  = NULL;
+
+    luaL_checktype(L, 2, LUA_TLIGHTUSERDATA);
+    // NOTE: the function pointer is passed as a lightuserdata in the same way
+    // as the symbol that is returned by dlsym(3)
+    *(void **)(&fn) = lua_touserdata(L, 2);
+    if (poll_job_register(name, fn) != 0) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, strerror(errno));
+        lua_pushinteger(L, errno);
+        return 3;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static poll_jobfn_t job_lookup(const char *name)
+{
+    poll_jobfn_t fn = NULL;
+
+    pthread_mutex_lock(&JOBS.mutex);
+    for (int i = 0; i < JOBS.njob; i++) {
+        if (strcmp(JOBS.list[i].name, name) == 0) {
+            fn = JOBS.list[i].fn;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&JOBS.mutex);
+
+    return fn;
+}
+
+int poll_job_submit_lua(lua_State *L)
+{
+    poll_t *p        = luaL_checkudata(L, 1, POLL_MT);
+    const char *name = luaL_checkstring(L, 2);
+    size_t len       = 0;
+    const char *arg  = NULL;
+    poll_jobfn_t fn  = NULL;
+    poll_job_t *job  = NULL;
+
+    if (!(fn = job_lookup(name))) {
+        return luaL_argerror(L, 2,
+                             lua_pushfstring(L, "unknown job %s", name));
+    }
+    if (!lua_isnoneornil(L, 3)) {
+        // NOTE: a number argument is converted to a string
+        arg = luaL_checklstring(L, 3, &len);
+    }
+    lua_settop(L, 4);
+
+    if (!(job = poll_job_new(arg, len))) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        lua_pushinteger(L, errno);
+        return 3;
+    }
+    job->fn = fn;
+    if (!poll_job_submit(L, p, 1, job)) {
+        int err = errno;
+        poll_job_free(job);
+        errno = err;
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        lua_pushinteger(L, errno);
+        return 3;
+    }
+    // keep udata reference
+    if (!lua_isnil(L, 4)) {
+        ((poll_event_t *)lua_touserdata(L, -1))->ref_udata = getrefat(L, 4);
+    }
+    return 1;
+}
+
+static int result_lua(lua_State *L)
+{
+    poll_event_t *ev = luaL_checkudata(L, 1, MODULE_MT);
+
+    pushref(L, ev->ref_ctx);
+    if (lua_istable(L, -1)) {
+        lua_getfield(L, -1, "result");
+        return 1;
+    }
+    lua_pushnil(L);
+    return 1;
+}
+
+static int is_enabled_lua(lua_State *L)
+{
+    return poll_event_is_enabled_lua(L, MODULE_MT);
+}
+
+static int udata_lua(lua_State *L)
+{
+    return poll_event_udata_lua(L, MODULE_MT);
+}
+
+static int type_lua(lua_State *L)
+{
+    lua_pushliteral(L, "job");
+    return 1;
+}
+
+static int tostring_lua(lua_State *L)
+{
+    return poll_event_tostring_lua(L, MODULE_MT);
+}
+
+static int gc_lua(lua_State *L)
+{
+    return poll_event_gc_lua(L);
+}
+
+void libopen_poll_job(lua_State *L)
+{
+    struct luaL_Reg mmethod[] = {
+        {"__gc",       gc_lua      },
+        {"__tostring", tostring_lua},
+        {NULL,         NULL        }
+    };
+    struct luaL_Reg method[] = {
+        {"type",       type_lua      },
+        {"is_enabled", is_enabled_lua},
+        {"udata",      udata_lua     },
+        {"result",     result_lua    },
+        {NULL,         NULL          }
+    };
+
+    // create metatable
+    luaL_newmetatable(L, MODULE_MT);
+    // metamethods
+    for (struct luaL_Reg *ptr = mmethod; ptr->name; ptr++) {
+        lua_pushcfunction(L, ptr->func);
+        lua_setfield(L, -2, ptr->name);
+    }
+    // methods
+    lua_newtable(L);
+    for (struct luaL_Reg *ptr = method; ptr->name; ptr++) {
+        lua_pushcfunction(L, ptr->func);
+        lua_setfield(L, -2, ptr->name);
+    }
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+}
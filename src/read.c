@@ -93,6 +93,284 @@
 //     return 1;
 // }
 
+int poll_accept_nonblock(int fd)
+{
+#if defined(HAVE_ACCEPT4)
+    return accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int sock = accept(fd, NULL, NULL);
+
+    if (sock != -1) {
+        int flg = fcntl(sock, F_GETFL);
+        if (flg == -1 || fcntl(sock, F_SETFL, flg | O_NONBLOCK) == -1 ||
+            fcntl(sock, F_SETFD, FD_CLOEXEC) == -1) {
+            int err = errno;
+            close(sock);
+            errno = err;
+            return -1;
+        }
+    }
+    return sock;
+#endif
+}
+
+// maximum number of connections that are accepted at once
+#define ACCEPT_MAX 128
+
+static int accept_lua(lua_State *L)
+{
+    static const char *const filters[] = {
+        "read",
+        "write",
+        NULL,
+    };
+    poll_event_t *ev = luaL_checkudata(L, 1, MODULE_MT);
+    lua_Integer max  = luaL_optinteger(L, 2, 0);
+    int tmpl         = !lua_isnoneornil(L, 3);
+    int flags        = 0;
+    int filter       = EVFILT_READ;
+    int n            = 0;
+
+    if (tmpl) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        flags = poll_checktrigger(L, 3, "trigger", 0);
+        lua_getfield(L, 3, "filter");
+        if (!lua_isnil(L, -1)) {
+            if (luaL_checkoption(L, -1, NULL, filters) == 1) {
+                filter = EVFILT_WRITE;
+            }
+        }
+        lua_pop(L, 1);
+    }
+    if (lua_isnoneornil(L, 2)) {
+        // default: number of pending connections in the listen backlog, or a
+        // single connection if no event has occurred yet
+        max = (ev->occ_evt.data > 0) ? ev->occ_evt.data : 1;
+    }
+    if (max <= 0 || max > ACCEPT_MAX) {
+        // accept until no pending connections exist up to the limit
+        max = ACCEPT_MAX;
+    }
+    lua_settop(L, 3);
+    if (tmpl) {
+        lua_getfield(L, 3, "udata");
+    } else {
+        lua_pushnil(L);
+    }
+    pushref(L, ev->ref_poll);
+    lua_createtable(L, 0, 0);
+
+    while (n < max) {
+        int fd = poll_accept_nonblock(ev->reg_evt.ident);
+
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // no more pending connections
+                break;
+            }
+            // got error
+            lua_pushstring(L, strerror(errno));
+            lua_pushinteger(L, errno);
+            return 3;
+        }
+
+        if (!tmpl) {
+            lua_pushinteger(L, fd);
+        } else {
+            // register an event for the accepted socket
+            poll_event_t *cev = poll_event_new(L, ev->p, 5);
+            EV_SET(&cev->reg_evt, fd, filter, flags, 0, 0, NULL);
+            if (!lua_isnil(L, 4)) {
+                cev->ref_udata = getrefat(L, 4);
+            }
+            if (poll_watch_event(L, cev, 7) != POLL_OK) {
+                int err = errno;
+                lua_pop(L, 1);
+                close(fd);
+                errno = err;
+                lua_pushstring(L, strerror(errno));
+                lua_pushinteger(L, errno);
+                return 3;
+            }
+            luaL_getmetatable(
+                L, (filter == EVFILT_READ) ? MODULE_MT : POLL_WRITE_MT);
+            lua_setmetatable(L, -2);
+        }
+        lua_rawseti(L, 6, ++n);
+    }
+
+    return 1;
+}
+
+/**
+ * receive buffer of the datagram messages.
+ * the buffer is allocated as a single block that is anchored at the "buf"
+ * field of the context table.
+ */
+typedef struct {
+    int nmsg;                       // number of message slots
+    size_t bufsize;                 // size of each slot
+    mmsg_t *msgs;                   // message headers
+    struct iovec *iov;              // iovec of each slot
+    struct sockaddr_storage *addrs; // source address of each slot
+    char *buf;                      // buffer of each slot
+} recvq_t;
+
+static int recvq_handler(lua_State *L, poll_event_t *ev)
+{
+    (void)L;
+    (void)ev;
+    // deliver the event to the caller
+    return POLL_OK;
+}
+
+static recvq_t *recvq_get(lua_State *L, poll_event_t *ev, int nmsg,
+                          size_t bufsize)
+{
+    recvq_t *rq = ev->ctx;
+    char *mem   = NULL;
+
+    if (ev->handler == recvq_handler) {
+        if (rq->nmsg >= nmsg && rq->bufsize >= bufsize) {
+            return rq;
+        }
+    } else if (ev->handler) {
+        // event is used by other handler
+        errno = EBUSY;
+        return NULL;
+    }
+
+    rq = poll_event_newctx(L, ev, recvq_handler, sizeof(recvq_t));
+    pushref(L, ev->ref_ctx);
+    mem = lua_newuserdata(L, (sizeof(mmsg_t) + sizeof(struct iovec) +
+                              sizeof(struct sockaddr_storage) + bufsize) *
+                                 nmsg);
+    lua_setfield(L, -2, "buf");
+    lua_pop(L, 1);
+
+    rq->nmsg    = nmsg;
+    rq->bufsize = bufsize;
+    rq->addrs   = (struct sockaddr_storage *)mem;
+    rq->msgs    = (mmsg_t *)(rq->addrs + nmsg);
+    rq->iov     = (struct iovec *)(rq->msgs + nmsg);
+    rq->buf     = (char *)(rq->iov + nmsg);
+
+    return rq;
+}
+
+static int recv_msgs(int fd, mmsg_t *msgs, int nmsg)
+{
+#if defined(HAVE_RECVMMSG)
+    int n = 0;
+    while ((n = recvmmsg(fd, msgs, nmsg, MSG_DONTWAIT, NULL)) == -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return n;
+#else
+    int n = 0;
+    while (n < nmsg) {
+        ssize_t len = recvmsg(fd, &msgs[n].msg_hdr, MSG_DONTWAIT);
+        if (len == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (n) {
+                // return the received messages
+                break;
+            }
+            return -1;
+        }
+        msgs[n++].msg_len = len;
+    }
+    return n;
+#endif
+}
+
+// maximum number of datagrams that are received at once
+#if defined(UIO_MAXIOV)
+# define RECV_MAX UIO_MAXIOV
+#else
+# define RECV_MAX 1024
+#endif
+
+static int recv_msgs_lua(lua_State *L)
+{
+    poll_event_t *ev    = luaL_checkudata(L, 1, MODULE_MT);
+    int has_addrs       = !lua_isnoneornil(L, 3);
+    lua_Integer max     = luaL_optinteger(L, 4, 16);
+    lua_Integer bufsize = luaL_optinteger(L, 5, 65536);
+    recvq_t *rq         = NULL;
+    int nmsg            = 0;
+    int n               = 0;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    if (has_addrs) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+    }
+    luaL_argcheck(L, max > 0, 4, "max must be > 0");
+    luaL_argcheck(L, max <= RECV_MAX, 4,
+                  lua_pushfstring(L, "max must be <= %d", RECV_MAX));
+    luaL_argcheck(L, bufsize > 0, 5, "bufsize must be > 0");
+    nmsg = max;
+
+    rq = recvq_get(L, ev, nmsg, bufsize);
+    if (!rq) {
+        goto FAIL;
+    }
+
+    // reset the message headers
+    for (int i = 0; i < nmsg; i++) {
+        rq->iov[i] = (struct iovec){
+            .iov_base = rq->buf + rq->bufsize * i,
+            .iov_len  = rq->bufsize,
+        };
+        memset(rq->msgs + i, 0, sizeof(mmsg_t));
+        rq->msgs[i].msg_hdr.msg_name    = rq->addrs + i;
+        rq->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        rq->msgs[i].msg_hdr.msg_iov     = rq->iov + i;
+        rq->msgs[i].msg_hdr.msg_iovlen  = 1;
+    }
+
+    n = recv_msgs(ev->reg_evt.ident, rq->msgs, nmsg);
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            goto FAIL;
+        }
+        n = 0;
+    }
+
+    for (int i = 0; i < n; i++) {
+        lua_pushlstring(L, rq->iov[i].iov_base, rq->msgs[i].msg_len);
+        lua_rawseti(L, 2, i + 1);
+        if (has_addrs) {
+            lua_pushlstring(L, (const char *)(rq->addrs + i),
+                            rq->msgs[i].msg_hdr.msg_namelen);
+            lua_rawseti(L, 3, i + 1);
+        }
+    }
+    lua_pushinteger(L, n);
+    return 1;
+
+FAIL:
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    lua_pushinteger(L, errno);
+    return 3;
+}
+
+static int mark_ready_lua(lua_State *L)
+{
+    return poll_event_mark_ready_lua(L, MODULE_MT);
+}
+
+static int idle_timeout_lua(lua_State *L)
+{
+    return poll_event_idle_timeout_lua(L, MODULE_MT);
+}
+
 static int getinfo_lua(lua_State *L)
 {
     return poll_event_getinfo_lua(L, MODULE_MT);
@@ -138,6 +416,45 @@ static int is_level_lua(lua_State *L)
     return poll_event_is_level_lua(L, MODULE_MT);
 }
 
+static int as_exclusive_lua(lua_State *L)
+{
+    poll_event_t *ev   = luaL_checkudata(L, 1, MODULE_MT);
+    lua_Number holdoff = luaL_optnumber(L, 2, 0);
+    event_t evt        = ev->reg_evt;
+
+    luaL_argcheck(L, holdoff >= 0, 2, "holdoff must be >= 0");
+    if (!EV_DISPATCH) {
+        // the kernel cannot disable the event on delivery
+        errno = ENOTSUP;
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        lua_pushinteger(L, errno);
+        return 3;
+    }
+
+    // NOTE: the kernel disables the event when it is delivered, and the
+    // kqueue instance re-enables it by the wait after the holdoff has elapsed.
+    // while the event is disabled, the other processes that watch the same
+    // descriptor receive the event instead.
+    evt.flags |= EV_DISPATCH;
+    if (poll_modify_event(L, ev, evt) != POLL_OK) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        lua_pushinteger(L, errno);
+        return 3;
+    }
+    ev->holdoff = holdoff;
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int is_exclusive_lua(lua_State *L)
+{
+    poll_event_t *ev = luaL_checkudata(L, 1, MODULE_MT);
+    lua_pushboolean(L, ev->reg_evt.flags & EV_DISPATCH);
+    return 1;
+}
+
 static int is_eof_lua(lua_State *L)
 {
     return poll_event_is_eof_lua(L, MODULE_MT);
@@ -148,6 +465,11 @@ static int is_enabled_lua(lua_State *L)
     return poll_event_is_enabled_lua(L, MODULE_MT);
 }
 
+static int modify_lua(lua_State *L)
+{
+    return poll_event_modify_lua(L, MODULE_MT);
+}
+
 static int unwatch_lua(lua_State *L)
 {
     return poll_event_unwatch_lua(L, MODULE_MT);
@@ -216,23 +538,30 @@ void libopen_poll_read(lua_State *L)
         {NULL,         NULL        }
     };
     struct luaL_Reg method[] = {
-        {"type",       type_lua      },
-        {"renew",      renew_lua     },
-        {"revert",     revert_lua    },
-        {"watch",      watch_lua     },
-        {"unwatch",    unwatch_lua   },
-        {"is_enabled", is_enabled_lua},
-        {"is_eof",     is_eof_lua    },
-        {"is_level",   is_level_lua  },
-        {"as_level",   as_level_lua  },
-        {"is_edge",    is_edge_lua   },
-        {"as_edge",    as_edge_lua   },
-        {"is_oneshot", is_oneshot_lua},
-        {"as_oneshot", as_oneshot_lua},
-        {"ident",      ident_lua     },
-        {"udata",      udata_lua     },
-        {"getinfo",    getinfo_lua   },
-        {NULL,         NULL          }
+        {"type",         type_lua        },
+        {"renew",        renew_lua       },
+        {"revert",       revert_lua      },
+        {"watch",        watch_lua       },
+        {"unwatch",      unwatch_lua     },
+        {"modify",       modify_lua      },
+        {"is_enabled",   is_enabled_lua  },
+        {"is_eof",       is_eof_lua      },
+        {"is_level",     is_level_lua    },
+        {"as_level",     as_level_lua    },
+        {"is_edge",      is_edge_lua     },
+        {"as_edge",      as_edge_lua     },
+        {"is_oneshot",   is_oneshot_lua  },
+        {"as_oneshot",   as_oneshot_lua  },
+        {"is_exclusive", is_exclusive_lua},
+        {"as_exclusive", as_exclusive_lua},
+        {"ident",        ident_lua       },
+        {"udata",        udata_lua       },
+        {"idle_timeout", idle_timeout_lua},
+        {"mark_ready",   mark_ready_lua  },
+        {"getinfo",      getinfo_lua     },
+        {"accept",       accept_lua      },
+        {"recv_msgs",    recv_msgs_lua   },
+        {NULL,           NULL            }
     };
 
     // create metatable
@@ -0,0 +1,323 @@
+/**
+ *  Copyright (C) 2023 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+#include "lua_kqueue.h"
+
+#define MODULE_MT POLL_RELAY_MT
+
+/**
+ * state of the relay between two descriptors.
+ * the data read from fd[i] is written to fd[!i] through buf[i], and the
+ * buffers are anchored at the "buf" field of the context table.
+ */
+typedef struct {
+    int fd[2];       // relayed descriptors
+    char *buf[2];    // buffer of the data read from fd[i]
+    size_t bufsize;  // size of each buffer
+    size_t len[2];   // number of pending bytes in buf[i]
+    size_t off[2];   // offset of the pending bytes in buf[i]
+    size_t nbyte[2]; // number of bytes relayed from fd[i] to fd[!i]
+    int eof[2];      // fd[i] reached the end of file
+    int rdon[2];     // read interest of fd[i] is enabled
+    int wron[2];     // write interest of fd[i] is enabled
+    int sflags[2];   // flags of poll_writev() for fd[i]
+} relay_t;
+
+int poll_relay_regs(poll_event_t *ev, event_t *regs)
+{
+    relay_t *r = ev->ctx;
+
+    for (int i = 0; i < 2; i++) {
+        EV_SET(&regs[i], r->fd[i], EVFILT_READ,
+               (r->rdon[i]) ? EV_ENABLE : EV_DISABLE, 0, 0, NULL);
+        EV_SET(&regs[i + 2], r->fd[i], EVFILT_WRITE,
+               (r->wron[i]) ? EV_ENABLE : EV_DISABLE, 0, 0, NULL);
+    }
+    return 4;
+}
+
+// enable the read interest while the buffer is empty and the write interest
+// while the data of the other side is pending
+static int relay_sync(poll_event_t *ev, relay_t *r)
+{
+    event_t changes[4];
+    int nchg = 0;
+
+    for (int i = 0; i < 2; i++) {
+        int rdon = !r->eof[i] && !r->len[i];
+        int wron = r->len[!i] > 0;
+
+        if (rdon != r->rdon[i]) {
+            r->rdon[i] = rdon;
+            EV_SET(&changes[nchg++], r->fd[i], EVFILT_READ,
+                   (rdon) ? EV_ENABLE : EV_DISABLE, 0, 0, NULL);
+        }
+        if (wron != r->wron[i]) {
+            r->wron[i] = wron;
+            EV_SET(&changes[nchg++], r->fd[i], EVFILT_WRITE,
+                   (wron) ? EV_ENABLE : EV_DISABLE, 0, 0, NULL);
+        }
+    }
+
+    if (nchg && poll_apply_changes(ev->p->fd, changes, nchg) != 0) {
+        return POLL_ERROR;
+    }
+    return POLL_OK;
+}
+
+// write the data read from fd[d] to fd[!d]
+static int relay_flush(relay_t *r, int d)
+{
+    while (r->len[d]) {
+        struct iovec iov = {
+            .iov_base = r->buf[d] + r->off[d],
+            .iov_len  = r->len[d],
+        };
+        // NOTE: the closed peer is reported as EPIPE instead of SIGPIPE
+        ssize_t n = poll_writev(r->fd[!d], r->sflags[!d], &iov, 1);
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return POLL_EALREADY;
+            }
+            return POLL_ERROR;
+        }
+        r->off[d] += n;
+        r->len[d] -= n;
+        r->nbyte[d] += n;
+    }
+    r->off[d] = 0;
+
+    if (r->eof[d]) {
+        // propagate the half-close to the other side
+        // NOTE: it fails if the descriptor is not a socket
+        shutdown(r->fd[!d], SHUT_WR);
+    }
+    return POLL_OK;
+}
+
+// read the data from fd[d] and write it to fd[!d]
+static int relay_read(relay_t *r, int d)
+{
+    ssize_t n = 0;
+
+    while ((n = read(r->fd[d], r->buf[d], r->bufsize)) == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return POLL_OK;
+        } else if (errno != EINTR) {
+            return POLL_ERROR;
+        }
+    }
+
+    if (n == 0) {
+        r->eof[d] = 1;
+    }
+    r->len[d] = n;
+    return relay_flush(r, d);
+}
+
+int poll_relay_handler(lua_State *L, poll_event_t *ev)
+{
+    relay_t *r   = ev->ctx;
+    event_t *evt = &ev->occ_evt;
+    int side     = (evt->ident == (uintptr_t)r->fd[0]) ? 0 : 1;
+    int rc       = POLL_OK;
+
+    if (evt->flags & EV_ERROR) {
+        errno = evt->data;
+        return POLL_ERROR;
+    } else if (evt->filter == EVFILT_READ) {
+        rc = relay_read(r, side);
+    } else {
+        // write the pending data of the other side
+        rc = relay_flush(r, !side);
+    }
+    if (rc == POLL_ERROR) {
+        return POLL_ERROR;
+    }
+
+    if (r->eof[0] && r->eof[1] && !r->len[0] && !r->len[1]) {
+        // both directions are closed; deliver the final event
+        if (poll_unwatch_event(L, ev) == POLL_ERROR) {
+            return POLL_ERROR;
+        }
+        return POLL_OK;
+    } else if (relay_sync(ev, r) != POLL_OK) {
+        return POLL_ERROR;
+    }
+    return POLL_EALREADY;
+}
+
+static int set_nonblock(int fd)
+{
+    int flg = fcntl(fd, F_GETFL);
+
+    if (flg == -1 || (!(flg & O_NONBLOCK) &&
+                      fcntl(fd, F_SETFL, flg | O_NONBLOCK) == -1)) {
+        return -1;
+    }
+    return 0;
+}
+
+int poll_relay_new(lua_State *L)
+{
+    poll_t *p           = luaL_checkudata(L, 1, POLL_MT);
+    int fd_a            = luaL_checkinteger(L, 2);
+    int fd_b            = luaL_checkinteger(L, 3);
+    lua_Integer bufsize = 16384;
+    poll_event_t *ev    = NULL;
+    relay_t *r          = NULL;
+    char *buf           = NULL;
+
+    lua_settop(L, 4);
+    if (!lua_isnil(L, 4)) {
+        luaL_checktype(L, 4, LUA_TTABLE);
+        lua_getfield(L, 4, "bufsize");
+        if (!lua_isnil(L, -1)) {
+            bufsize = lua_tointeger(L, -1);
+            if (lua_type(L, -1) != LUA_TNUMBER || bufsize <= 0) {
+                return luaL_argerror(L, 4, "bufsize must be integer > 0");
+            }
+        }
+        lua_pop(L, 1);
+    }
+
+    if (fd_a == fd_b) {
+        errno = EINVAL;
+        goto FAIL;
+    } else if (set_nonblock(fd_a) == -1 || set_nonblock(fd_b) == -1) {
+        goto FAIL;
+    }
+
+    ev = poll_event_new(L, p, 1);
+    if (!lua_isnil(L, 4)) {
+        lua_getfield(L, 4, "udata");
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+        } else {
+            ev->ref_udata = getref(L);
+        }
+    }
+
+    r = poll_event_newctx(L, ev, poll_relay_handler, sizeof(relay_t));
+    pushref(L, ev->ref_ctx);
+    buf = lua_newuserdata(L, bufsize * 2);
+    lua_setfield(L, -2, "buf");
+    lua_pop(L, 1);
+    *r = (relay_t){
+        .fd      = {fd_a, fd_b},
+        .buf     = {buf, buf + bufsize},
+        .bufsize = bufsize,
+        .rdon    = {1, 1},
+        .sflags  = {poll_sendflags(fd_a), poll_sendflags(fd_b)},
+    };
+
+    EV_SET(&ev->reg_evt, fd_a, EVFILT_READ, 0, 0, 0, NULL);
+    if (poll_watch_event(L, ev, 5) != POLL_OK) {
+        goto FAIL;
+    }
+    luaL_getmetatable(L, MODULE_MT);
+    lua_setmetatable(L, 5);
+    return 1;
+
+FAIL:
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    lua_pushinteger(L, errno);
+    return 3;
+}
+
+static int nbyte_lua(lua_State *L)
+{
+    poll_event_t *ev = luaL_checkudata(L, 1, MODULE_MT);
+    relay_t *r       = ev->ctx;
+
+    lua_pushinteger(L, r->nbyte[0]);
+    lua_pushinteger(L, r->nbyte[1]);
+    return 2;
+}
+
+static int udata_lua(lua_State *L)
+{
+    return poll_event_udata_lua(L, MODULE_MT);
+}
+
+static int is_enabled_lua(lua_State *L)
+{
+    return poll_event_is_enabled_lua(L, MODULE_MT);
+}
+
+static int unwatch_lua(lua_State *L)
+{
+    return poll_event_unwatch_lua(L, MODULE_MT);
+}
+
+static int type_lua(lua_State *L)
+{
+    lua_pushliteral(L, "relay");
+    return 1;
+}
+
+static int tostring_lua(lua_State *L)
+{
+    return poll_event_tostring_lua(L, MODULE_MT);
+}
+
+static int gc_lua(lua_State *L)
+{
+    return poll_event_gc_lua(L);
+}
+
+void libopen_poll_relay(lua_State *L)
+{
+    struct luaL_Reg mmethod[] = {
+        {"__gc",       gc_lua      },
+        {"__tostring", tostring_lua},
+        {NULL,         NULL        }
+    };
+    struct luaL_Reg method[] = {
+        {"type",       type_lua      },
+        {"unwatch",    unwatch_lua   },
+        {"is_enabled", is_enabled_lua},
+        {"udata",      udata_lua     },
+        {"nbyte",      nbyte_lua     },
+        {NULL,         NULL          }
+    };
+
+    // create metatable
+    luaL_newmetatable(L, MODULE_MT);
+    // metamethods
+    for (struct luaL_Reg *ptr = mmethod; ptr->name; ptr++) {
+        lua_pushcfunction(L, ptr->func);
+        lua_setfield(L, -2, ptr->name);
+    }
+    // methods
+    lua_newtable(L);
+    for (struct luaL_Reg *ptr = method; ptr->name; ptr++) {
+        lua_pushcfunction(L, ptr->func);
+        lua_setfield(L, -2, ptr->name);
+    }
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+}
@@ -119,6 +119,11 @@ static int is_enabled_lua(lua_State *L)
     return poll_event_is_enabled_lua(L, MODULE_MT);
 }
 
+static int modify_lua(lua_State *L)
+{
+    return poll_event_modify_lua(L, MODULE_MT);
+}
+
 static int unwatch_lua(lua_State *L)
 {
     return poll_event_unwatch_lua(L, MODULE_MT);
@@ -157,14 +162,104 @@ static int gc_lua(lua_State *L)
 
 static sigset_t ALL_SIGNALS;
 
-int poll_signal_new(lua_State *L)
+// disposition of the signals that are ignored by the signal events
+static struct {
+    int nref;
+    struct sigaction act;
+} IGNORED[NSIG];
+
+void poll_signal_ignore(poll_event_t *ev)
 {
-    poll_event_t *ev = luaL_checkudata(L, 1, POLL_EVENT_MT);
-    int signo        = luaL_checkinteger(L, 2);
+    if (!ev->sigign) {
+        return;
+    }
+
+    for (int signo = 1; signo < NSIG; signo++) {
+        if (sigismember(&ev->sigset, signo) == 1 &&
+            IGNORED[signo].nref++ == 0) {
+            // NOTE: the kqueue can report the signals even if it is ignored.
+            // but the SIGCHLD must not be ignored, because the zombie
+            // processes are reaped automatically and the signal is not
+            // reported.
+            struct sigaction act = {
+                .sa_handler = (signo == SIGCHLD) ? SIG_DFL : SIG_IGN,
+            };
+            sigemptyset(&act.sa_mask);
+            sigaction(signo, &act, &IGNORED[signo].act);
+        }
+    }
+}
+
+void poll_signal_restore(poll_event_t *ev)
+{
+    if (!ev->sigign) {
+        return;
+    }
+
+    for (int signo = 1; signo < NSIG; signo++) {
+        if (sigismember(&ev->sigset, signo) == 1 &&
+            --IGNORED[signo].nref == 0) {
+            sigaction(signo, &IGNORED[signo].act, NULL);
+        }
+    }
+}
+
+static int count_lua(lua_State *L)
+{
+    poll_event_t *ev = luaL_checkudata(L, 1, MODULE_MT);
+
+    // NOTE: the signals delivered since the last occurrence are coalesced into
+    // a single event, and the data field holds the number of deliveries.
+    lua_pushinteger(L, ev->occ_evt.data);
+    lua_pushinteger(L, ev->occ_evt.ident);
+    return 2;
+}
+
+static int checksigno(lua_State *L, int idx, sigset_t *set)
+{
+    int signo = luaL_checkinteger(L, idx);
 
     // check if signal is valid
     if (signo <= 0 || signo >= NSIG || sigismember(&ALL_SIGNALS, signo) != 1) {
         errno = EINVAL;
+        return -1;
+    }
+    sigaddset(set, signo);
+    return signo;
+}
+
+int poll_signal_new(lua_State *L)
+{
+    poll_event_t *ev = luaL_checkudata(L, 1, POLL_EVENT_MT);
+    int ignore       = lua_toboolean(L, 4);
+    int ident        = 0;
+    sigset_t set;
+
+    sigemptyset(&set);
+    if (lua_type(L, 2) != LUA_TTABLE) {
+        ident = checksigno(L, 2, &set);
+    } else {
+        // watch the signal set
+        ident = -1;
+        errno = EINVAL;
+        for (int i = 1;; i++) {
+            lua_rawgeti(L, 2, i);
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+                break;
+            }
+            int signo = checksigno(L, -1, &set);
+            lua_pop(L, 1);
+            if (signo == -1) {
+                ident = -1;
+                break;
+            } else if (ident == -1 || signo < ident) {
+                // use the lowest signal number as the identifier
+                ident = signo;
+            }
+        }
+    }
+    if (ident == -1) {
         lua_pushnil(L);
         lua_pushstring(L, strerror(errno));
         lua_pushinteger(L, errno);
@@ -176,7 +271,9 @@ int poll_signal_new(lua_State *L)
         ev->ref_udata = getrefat(L, 3);
     }
 
-    EV_SET(&ev->reg_evt, signo, EVFILT_SIGNAL, ev->reg_evt.flags, 0, 0, NULL);
+    EV_SET(&ev->reg_evt, ident, EVFILT_SIGNAL, ev->reg_evt.flags, 0, 0, NULL);
+    ev->sigset = set;
+    ev->sigign = ignore;
     if (poll_watch_event(L, ev, 1) != POLL_OK) {
         lua_pushnil(L);
         lua_pushstring(L, strerror(errno));
@@ -202,6 +299,7 @@ void libopen_poll_signal(lua_State *L)
         {"revert",     revert_lua    },
         {"watch",      watch_lua     },
         {"unwatch",    unwatch_lua   },
+        {"modify",     modify_lua    },
         {"is_enabled", is_enabled_lua},
         {"is_eof",     is_eof_lua    },
         {"is_level",   is_level_lua  },
@@ -213,6 +311,7 @@ void libopen_poll_signal(lua_State *L)
         {"ident",      ident_lua     },
         {"udata",      udata_lua     },
         {"getinfo",    getinfo_lua   },
+        {"count",      count_lua     },
         {NULL,         NULL          }
     };
 
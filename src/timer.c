@@ -129,6 +129,11 @@ static int is_enabled_lua(lua_State *L)
     return poll_event_is_enabled_lua(L, MODULE_MT);
 }
 
+static int modify_lua(lua_State *L)
+{
+    return poll_event_modify_lua(L, MODULE_MT);
+}
+
 static int unwatch_lua(lua_State *L)
 {
     return poll_event_unwatch_lua(L, MODULE_MT);
@@ -168,7 +173,8 @@ static int gc_lua(lua_State *L)
 int poll_timer_new(lua_State *L)
 {
     poll_event_t *ev = luaL_checkudata(L, 1, POLL_EVENT_MT);
-    int ident        = luaL_checkinteger(L, 2);
+    // allocate an ident automatically if nil
+    uintptr_t ident  = luaL_optinteger(L, 2, 0);
     lua_Number sec   = luaL_checknumber(L, 3);
     int msec         = sec * 1000;
 
@@ -186,8 +192,10 @@ int poll_timer_new(lua_State *L)
         ev->ref_udata = getrefat(L, 4);
     }
 
+    ev->autoident = lua_isnoneornil(L, 2);
     EV_SET(&ev->reg_evt, ident, EVFILT_TIMER, ev->reg_evt.flags, 0, msec, NULL);
     if (poll_watch_event(L, ev, 1) != POLL_OK) {
+        ev->autoident = 0;
         lua_pushnil(L);
         lua_pushstring(L, strerror(errno));
         lua_pushinteger(L, errno);
@@ -212,6 +220,7 @@ void libopen_poll_timer(lua_State *L)
         {"revert",     revert_lua    },
         {"watch",      watch_lua     },
         {"unwatch",    unwatch_lua   },
+        {"modify",     modify_lua    },
         {"is_enabled", is_enabled_lua},
         {"is_eof",     is_eof_lua    },
         {"is_level",   is_level_lua  },
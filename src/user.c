@@ -0,0 +1,209 @@
+/**
+ *  Copyright (C) 2023 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+#include "lua_kqueue.h"
+
+#define MODULE_MT POLL_USER_MT
+
+static int trigger(int fd, uintptr_t ident)
+{
+#if defined(EVFILT_USER)
+    event_t evt;
+
+    EV_SET(&evt, ident, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    if (poll_apply_changes(fd, &evt, 1) != 0) {
+        return -1;
+    }
+    return 0;
+#else
+    (void)fd;
+    (void)ident;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+static int trigger_lua(lua_State *L)
+{
+    poll_event_t *ev = luaL_checkudata(L, 1, MODULE_MT);
+
+    if (!ev->enabled) {
+        errno = ENOENT;
+    } else if (trigger(ev->p->fd, ev->reg_evt.ident) == 0) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, strerror(errno));
+    lua_pushinteger(L, errno);
+    return 3;
+}
+
+// NOTE: this function can be called from any thread that has the kqueue
+// descriptor
+int poll_user_trigger_lua(lua_State *L)
+{
+    int fd          = luaL_checkinteger(L, 1);
+    uintptr_t ident = luaL_checkinteger(L, 2);
+
+    if (trigger(fd, ident) == 0) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, strerror(errno));
+    lua_pushinteger(L, errno);
+    return 3;
+}
+
+static int udata_lua(lua_State *L)
+{
+    return poll_event_udata_lua(L, MODULE_MT);
+}
+
+static int getinfo_lua(lua_State *L)
+{
+    return poll_event_getinfo_lua(L, MODULE_MT);
+}
+
+static int ident_lua(lua_State *L)
+{
+    return poll_event_ident_lua(L, MODULE_MT);
+}
+
+static int is_enabled_lua(lua_State *L)
+{
+    return poll_event_is_enabled_lua(L, MODULE_MT);
+}
+
+static int unwatch_lua(lua_State *L)
+{
+    return poll_event_unwatch_lua(L, MODULE_MT);
+}
+
+static int watch_lua(lua_State *L)
+{
+    return poll_event_watch_lua(L, MODULE_MT);
+}
+
+static int revert_lua(lua_State *L)
+{
+    return poll_event_revert_lua(L, MODULE_MT);
+}
+
+static int renew_lua(lua_State *L)
+{
+    return poll_event_renew_lua(L, MODULE_MT);
+}
+
+static int type_lua(lua_State *L)
+{
+    lua_pushliteral(L, "user");
+    return 1;
+}
+
+static int tostring_lua(lua_State *L)
+{
+    return poll_event_tostring_lua(L, MODULE_MT);
+}
+
+static int gc_lua(lua_State *L)
+{
+    return poll_event_gc_lua(L);
+}
+
+int poll_user_new(lua_State *L)
+{
+    poll_event_t *ev = luaL_checkudata(L, 1, POLL_EVENT_MT);
+    // allocate an ident automatically if nil
+    uintptr_t ident  = luaL_optinteger(L, 2, 0);
+
+#if defined(EVFILT_USER)
+    // keep udata reference
+    if (!lua_isnoneornil(L, 3)) {
+        ev->ref_udata = getrefat(L, 3);
+    }
+
+    // NOTE: EV_CLEAR is required to reset the state after the event is
+    // delivered
+    ev->autoident = lua_isnoneornil(L, 2);
+    EV_SET(&ev->reg_evt, ident, EVFILT_USER, ev->reg_evt.flags | EV_CLEAR,
+           NOTE_FFNOP, 0, NULL);
+    if (poll_watch_event(L, ev, 1) != POLL_OK) {
+        ev->autoident = 0;
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        lua_pushinteger(L, errno);
+        return 3;
+    }
+    lua_settop(L, 1);
+    luaL_getmetatable(L, MODULE_MT);
+    lua_setmetatable(L, -2);
+    return 1;
+#else
+    (void)ev;
+    (void)ident;
+    errno = EOPNOTSUPP;
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    lua_pushinteger(L, errno);
+    return 3;
+#endif
+}
+
+void libopen_poll_user(lua_State *L)
+{
+    struct luaL_Reg mmethod[] = {
+        {"__gc",       gc_lua      },
+        {"__tostring", tostring_lua},
+        {NULL,         NULL        }
+    };
+    struct luaL_Reg method[] = {
+        {"type",       type_lua      },
+        {"renew",      renew_lua     },
+        {"revert",     revert_lua    },
+        {"watch",      watch_lua     },
+        {"unwatch",    unwatch_lua   },
+        {"is_enabled", is_enabled_lua},
+        {"ident",      ident_lua     },
+        {"udata",      udata_lua     },
+        {"getinfo",    getinfo_lua   },
+        {"trigger",    trigger_lua   },
+        {NULL,         NULL          }
+    };
+
+    // create metatable
+    luaL_newmetatable(L, MODULE_MT);
+    // metamethods
+    for (struct luaL_Reg *ptr = mmethod; ptr->name; ptr++) {
+        lua_pushcfunction(L, ptr->func);
+        lua_setfield(L, -2, ptr->name);
+    }
+    // methods
+    lua_newtable(L);
+    for (struct luaL_Reg *ptr = method; ptr->name; ptr++) {
+        lua_pushcfunction(L, ptr->func);
+        lua_setfield(L, -2, ptr->name);
+    }
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+}
@@ -21,9 +21,649 @@
  */
 
 #include "lua_kqueue.h"
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #define MODULE_MT POLL_WRITE_MT
 
+#ifndef IOV_MAX
+# define IOV_MAX 1024
+#endif
+
+/**
+ * output queue of the write event.
+ * the queued strings are anchored in the context table at the index of the
+ * slot + 1, the destination addresses at the negative index of the slot + 1,
+ * and the iovec lists are anchored at the "iov" field.
+ */
+typedef struct {
+    struct iovec *iov;  // list of queued strings
+    struct iovec *addr; // list of destination addresses
+    int dgram;          // queued strings are sent as datagrams
+    int size;           // capacity of the list
+    int head;          // slot of the first pending string
+    int tail;          // slot of the next queued string
+    size_t nbyte;      // number of pending bytes
+    size_t lowat;      // low watermark
+    size_t hiwat;      // high watermark
+    int above;         // pending bytes have exceeded the high watermark
+    int armed;         // write interest is enabled in the kernel
+    int sendflags;     // flags of poll_writev()
+} writeq_t;
+
+// NOTE: the context table must be placed on the stack top
+static void writeq_push(lua_State *L, writeq_t *wq, int idx, int addridx)
+{
+    size_t len       = 0;
+    const char *str  = lua_tolstring(L, idx, &len);
+    size_t alen      = 0;
+    const char *addr = NULL;
+
+    if (!len && !wq->dgram) {
+        return;
+    } else if (addridx && !lua_isnoneornil(L, addridx)) {
+        addr = lua_tolstring(L, addridx, &alen);
+    }
+
+    if (wq->tail == wq->size) {
+        if (wq->head > 0) {
+            // move the pending strings to the front
+            int n = wq->tail - wq->head;
+            memmove(wq->iov, wq->iov + wq->head, sizeof(struct iovec) * n);
+            memmove(wq->addr, wq->addr + wq->head, sizeof(struct iovec) * n);
+            for (int i = 0; i < n; i++) {
+                lua_rawgeti(L, -1, wq->head + i + 1);
+                lua_rawseti(L, -2, i + 1);
+                lua_rawgeti(L, -1, -(wq->head + i + 1));
+                lua_rawseti(L, -2, -(i + 1));
+            }
+            for (int i = n; i < wq->tail; i++) {
+                lua_pushnil(L);
+                lua_rawseti(L, -2, i + 1);
+                lua_pushnil(L);
+                lua_rawseti(L, -2, -(i + 1));
+            }
+            wq->head = 0;
+            wq->tail = n;
+        } else {
+            // grow the list
+            int size = (wq->size) ? wq->size * 2 : 16;
+            struct iovec *iov =
+                lua_newuserdata(L, sizeof(struct iovec) * size * 2);
+            if (wq->tail) {
+                memcpy(iov, wq->iov, sizeof(struct iovec) * wq->tail);
+                memcpy(iov + size, wq->addr, sizeof(struct iovec) * wq->tail);
+            }
+            lua_setfield(L, -2, "iov");
+            wq->iov  = iov;
+            wq->addr = iov + size;
+            wq->size = size;
+        }
+    }
+
+    // anchor the string
+    lua_pushvalue(L, idx);
+    lua_rawseti(L, -2, wq->tail + 1);
+    if (addr) {
+        lua_pushvalue(L, addridx);
+        lua_rawseti(L, -2, -(wq->tail + 1));
+    }
+    wq->addr[wq->tail] = (struct iovec){
+        .iov_base = (void *)addr,
+        .iov_len  = alen,
+    };
+    wq->iov[wq->tail++] = (struct iovec){
+        .iov_base = (void *)str,
+        .iov_len  = len,
+    };
+    wq->nbyte += len;
+}
+
+static int send_msgs(int fd, mmsg_t *msgs, int nmsg, int flags)
+{
+#if defined(HAVE_SENDMMSG)
+    return sendmmsg(fd, msgs, nmsg, flags);
+#else
+    int n = 0;
+    while (n < nmsg) {
+        ssize_t len = sendmsg(fd, &msgs[n].msg_hdr, flags);
+        if (len == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (n) {
+                // return the sent messages
+                break;
+            }
+            return -1;
+        }
+        msgs[n++].msg_len = len;
+    }
+    return n;
+#endif
+}
+
+#define NMSG 64
+
+// NOTE: the context table must be placed on the stack top
+static int writeq_flush_msgs(lua_State *L, poll_event_t *ev, writeq_t *wq)
+{
+    mmsg_t msgs[NMSG];
+
+    while (wq->head < wq->tail) {
+        int nmsg = wq->tail - wq->head;
+        int n    = 0;
+
+        if (nmsg > NMSG) {
+            nmsg = NMSG;
+        }
+        memset(msgs, 0, sizeof(mmsg_t) * nmsg);
+        for (int i = 0; i < nmsg; i++) {
+            struct iovec *addr          = wq->addr + wq->head + i;
+            msgs[i].msg_hdr.msg_name    = addr->iov_base;
+            msgs[i].msg_hdr.msg_namelen = addr->iov_len;
+            msgs[i].msg_hdr.msg_iov     = wq->iov + wq->head + i;
+            msgs[i].msg_hdr.msg_iovlen  = 1;
+        }
+
+        n = send_msgs(ev->reg_evt.ident, msgs, nmsg,
+                      (wq->sendflags == -1) ? 0 : wq->sendflags);
+        if (n == -1) {
+            int err = errno;
+
+            if (err == EINTR) {
+                continue;
+            } else if (err == EAGAIN || err == EWOULDBLOCK) {
+                return POLL_EALREADY;
+            }
+            // drop the datagram that cannot be sent
+            wq->nbyte -= wq->iov[wq->head].iov_len;
+            lua_pushnil(L);
+            lua_rawseti(L, -2, -(wq->head + 1));
+            lua_pushnil(L);
+            lua_rawseti(L, -2, ++wq->head);
+            errno = err;
+            return POLL_ERROR;
+        }
+
+        // release the sent datagrams
+        for (int i = 0; i < n; i++) {
+            wq->nbyte -= wq->iov[wq->head].iov_len;
+            lua_pushnil(L);
+            lua_rawseti(L, -2, -(wq->head + 1));
+            lua_pushnil(L);
+            lua_rawseti(L, -2, ++wq->head);
+        }
+    }
+    return POLL_OK;
+}
+
+static int writeq_flush(lua_State *L, poll_event_t *ev, writeq_t *wq)
+{
+    int rc = POLL_OK;
+
+    pushref(L, ev->ref_ctx);
+    if (wq->dgram) {
+        rc = writeq_flush_msgs(L, ev, wq);
+    }
+    while (!wq->dgram && wq->head < wq->tail) {
+        int iovcnt = wq->tail - wq->head;
+        ssize_t n  = 0;
+
+        if (iovcnt > IOV_MAX) {
+            iovcnt = IOV_MAX;
+        }
+        n = poll_writev(ev->reg_evt.ident, wq->sendflags, wq->iov + wq->head,
+                        iovcnt);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                rc = POLL_EALREADY;
+            } else {
+                rc = POLL_ERROR;
+            }
+            break;
+        }
+        wq->nbyte -= n;
+
+        // release the written strings
+        while (n > 0) {
+            struct iovec *iov = wq->iov + wq->head;
+            if ((size_t)n < iov->iov_len) {
+                iov->iov_base = (char *)iov->iov_base + n;
+                iov->iov_len -= n;
+                break;
+            }
+            n -= iov->iov_len;
+            lua_pushnil(L);
+            lua_rawseti(L, -2, ++wq->head);
+        }
+    }
+    lua_pop(L, 1);
+
+    if (wq->head == wq->tail) {
+        wq->head = 0;
+        wq->tail = 0;
+    }
+    return rc;
+}
+
+static int rearm_oneshot(poll_event_t *ev)
+{
+    if (ev->reg_evt.flags & EV_ONESHOT) {
+        event_t evt = ev->reg_evt;
+        evt.flags |= EV_ADD;
+        if (poll_apply_changes(ev->p->fd, &evt, 1) != 0) {
+            return POLL_ERROR;
+        }
+    }
+    return POLL_OK;
+}
+
+// enable or disable the write interest without removing the registration
+static int writeq_arm(poll_event_t *ev, writeq_t *wq, int on)
+{
+    event_t evt = ev->reg_evt;
+
+    if (wq->armed == on) {
+        return POLL_OK;
+    }
+    // NOTE: EV_ADD re-registers the oneshot event that has been fired
+    evt.flags |= (on) ? EV_ADD | EV_ENABLE : EV_DISABLE;
+    if (poll_apply_changes(ev->p->fd, &evt, 1) != 0) {
+        return POLL_ERROR;
+    }
+    wq->armed = on;
+    return POLL_OK;
+}
+
+static int writeq_handler(lua_State *L, poll_event_t *ev)
+{
+    writeq_t *wq = ev->ctx;
+
+    // the oneshot registration is deleted by the kernel when it is fired
+    wq->armed = !(ev->reg_evt.flags & EV_ONESHOT);
+    if (ev->occ_evt.flags & (EV_EOF | EV_ERROR)) {
+        // deliver the event as is
+        return POLL_OK;
+    }
+
+    switch (writeq_flush(L, ev, wq)) {
+    case POLL_OK:
+        // disable the write interest while no data is pending
+        if (writeq_arm(ev, wq, 0) == POLL_ERROR) {
+            return POLL_ERROR;
+        }
+        break;
+
+    case POLL_EALREADY:
+        if (writeq_arm(ev, wq, 1) != POLL_OK) {
+            return POLL_ERROR;
+        }
+        break;
+
+    default:
+        return POLL_ERROR;
+    }
+
+    if (wq->above && wq->nbyte <= wq->lowat) {
+        // deliver the event when the pending bytes fall below the low
+        // watermark
+        wq->above = 0;
+        return POLL_OK;
+    }
+    return POLL_EALREADY;
+}
+
+static writeq_t *writeq_get(lua_State *L, poll_event_t *ev)
+{
+    writeq_t *wq = NULL;
+
+    if (ev->handler == writeq_handler) {
+        return ev->ctx;
+    } else if (ev->handler) {
+        // event is used by other handler
+        errno = EBUSY;
+        return NULL;
+    }
+    wq            = poll_event_newctx(L, ev, writeq_handler, sizeof(writeq_t));
+    wq->armed     = ev->enabled;
+    wq->sendflags = poll_sendflags(ev->reg_evt.ident);
+    return wq;
+}
+
+// NOTE: pending is the state of the queue before the strings were queued
+static int writeq_commit(lua_State *L, poll_event_t *ev, writeq_t *wq,
+                         int pending)
+{
+    if (wq->hiwat && wq->nbyte > wq->hiwat) {
+        wq->above = 1;
+    }
+
+    if (!pending && wq->nbyte) {
+        // write immediately if no data was pending
+        switch (writeq_flush(L, ev, wq)) {
+        case POLL_OK:
+            if (ev->enabled && writeq_arm(ev, wq, 0) == POLL_ERROR) {
+                goto FAIL;
+            }
+            break;
+
+        case POLL_EALREADY:
+            break;
+
+        default:
+            goto FAIL;
+        }
+        if (wq->above && wq->nbyte <= wq->lowat) {
+            wq->above = 0;
+        }
+    }
+
+    // enable the write interest while data is pending
+    if (wq->nbyte) {
+        if (!ev->enabled) {
+            if (poll_watch_event(L, ev, 1) != POLL_OK) {
+                goto FAIL;
+            }
+            wq->armed = 1;
+        } else if (writeq_arm(ev, wq, 1) != POLL_OK) {
+            goto FAIL;
+        }
+    }
+
+    lua_pushinteger(L, wq->nbyte);
+    return 1;
+
+FAIL:
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    lua_pushinteger(L, errno);
+    return 3;
+}
+
+static int enqueue_lua(lua_State *L)
+{
+    poll_event_t *ev = luaL_checkudata(L, 1, MODULE_MT);
+    int narg         = lua_gettop(L);
+    writeq_t *wq     = NULL;
+    int pending      = 0;
+
+    for (int i = 2; i <= narg; i++) {
+        luaL_checkstring(L, i);
+    }
+
+    wq = writeq_get(L, ev);
+    if (!wq) {
+        goto FAIL;
+    }
+    pending = wq->head < wq->tail;
+    if (pending && wq->dgram) {
+        // datagrams are pending
+        errno = EINVAL;
+        goto FAIL;
+    }
+    wq->dgram = 0;
+
+    pushref(L, ev->ref_ctx);
+    for (int i = 2; i <= narg; i++) {
+        writeq_push(L, wq, i, 0);
+    }
+    lua_pop(L, 1);
+    return writeq_commit(L, ev, wq, pending);
+
+FAIL:
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    lua_pushinteger(L, errno);
+    return 3;
+}
+
+static int enqueue_msg_lua(lua_State *L)
+{
+    poll_event_t *ev = luaL_checkudata(L, 1, MODULE_MT);
+    writeq_t *wq     = NULL;
+    int pending      = 0;
+
+    luaL_checkstring(L, 2);
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checkstring(L, 3);
+    }
+    lua_settop(L, 3);
+
+    wq = writeq_get(L, ev);
+    if (!wq) {
+        goto FAIL;
+    }
+    pending = wq->head < wq->tail;
+    if (pending && !wq->dgram) {
+        // stream data is pending
+        errno = EINVAL;
+        goto FAIL;
+    }
+    wq->dgram = 1;
+
+    pushref(L, ev->ref_ctx);
+    writeq_push(L, wq, 2, 3);
+    lua_pop(L, 1);
+    return writeq_commit(L, ev, wq, pending);
+
+FAIL:
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    lua_pushinteger(L, errno);
+    return 3;
+}
+
+/**
+ * sendfile job of the write event.
+ */
+typedef struct {
+    int fd;        // source file descriptor
+    off_t offset;  // offset of the next byte to send
+    size_t remain; // number of bytes to send
+    int fallback;  // use pread and write instead of sendfile
+    int sendflags; // flags of the fallback write
+} sendfile_t;
+
+static ssize_t sendfile_once(int sock, sendfile_t *sf)
+{
+    if (sf->fallback) {
+        char buf[16384];
+        size_t len = (sf->remain < sizeof(buf)) ? sf->remain : sizeof(buf);
+        ssize_t n  = pread(sf->fd, buf, len, sf->offset);
+
+        struct iovec iov = {
+            .iov_base = buf,
+        };
+
+        if (n <= 0) {
+            return n;
+        }
+        iov.iov_len = n;
+        return poll_writev(sock, sf->sendflags, &iov, 1);
+    }
+
+#if defined(HAVE_SENDFILE) && (defined(__FreeBSD__) || defined(__DragonFly__))
+    off_t sbytes = 0;
+    if (sendfile(sf->fd, sock, sf->offset, sf->remain, NULL, &sbytes, 0) ==
+            -1 &&
+        sbytes == 0) {
+        return -1;
+    }
+    return sbytes;
+#elif defined(HAVE_SENDFILE) && defined(__APPLE__)
+    off_t len = sf->remain;
+    if (sendfile(sf->fd, sock, sf->offset, &len, NULL, 0) == -1 && len == 0) {
+        return -1;
+    }
+    return len;
+#else
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+static int sendfile_flush(int sock, sendfile_t *sf)
+{
+    while (sf->remain) {
+        ssize_t n = sendfile_once(sock, sf);
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return POLL_EALREADY;
+            } else if (!sf->fallback &&
+                       (errno == ENOTSOCK || errno == EINVAL ||
+                        errno == EOPNOTSUPP || errno == ENOTSUP)) {
+                // descriptors are not supported by sendfile
+                sf->fallback = 1;
+                continue;
+            }
+            return POLL_ERROR;
+        } else if (n == 0) {
+            // reached the end of file
+            sf->remain = 0;
+            break;
+        }
+        sf->offset += n;
+        sf->remain -= n;
+    }
+    return POLL_OK;
+}
+
+static int sendfile_handler(lua_State *L, poll_event_t *ev)
+{
+    if (ev->occ_evt.flags & (EV_EOF | EV_ERROR)) {
+        // deliver the event as is, and the job is abandoned
+        poll_event_delctx(L, ev);
+        return POLL_OK;
+    }
+
+    switch (sendfile_flush(ev->reg_evt.ident, ev->ctx)) {
+    case POLL_OK:
+        // deliver the completion and disable the write interest
+        poll_event_delctx(L, ev);
+        if (poll_unwatch_event(L, ev) == POLL_ERROR) {
+            return POLL_ERROR;
+        }
+        return POLL_OK;
+
+    case POLL_EALREADY:
+        if (rearm_oneshot(ev) != POLL_OK) {
+            return POLL_ERROR;
+        }
+        return POLL_EALREADY;
+
+    default: {
+        int err = errno;
+        poll_event_delctx(L, ev);
+        errno = err;
+        return POLL_ERROR;
+    }
+    }
+}
+
+static int sendfile_lua(lua_State *L)
+{
+    poll_event_t *ev   = luaL_checkudata(L, 1, MODULE_MT);
+    int fd             = luaL_checkinteger(L, 2);
+    lua_Integer offset = luaL_optinteger(L, 3, 0);
+    lua_Integer length = luaL_optinteger(L, 4, 0);
+    sendfile_t *sf     = NULL;
+
+    luaL_argcheck(L, offset >= 0, 3, "offset must be >= 0");
+    luaL_argcheck(L, length >= 0, 4, "length must be >= 0");
+
+    if (ev->handler == writeq_handler && !((writeq_t *)ev->ctx)->nbyte) {
+        // output queue is empty
+        if (ev->enabled && writeq_arm(ev, ev->ctx, 1) != POLL_OK) {
+            goto FAIL;
+        }
+        poll_event_delctx(L, ev);
+    } else if (ev->handler) {
+        // event is used by other handler
+        errno = EBUSY;
+        goto FAIL;
+    }
+
+    if (length == 0) {
+        // send until the end of file
+        struct stat st = {0};
+        if (fstat(fd, &st) == -1) {
+            goto FAIL;
+        } else if (st.st_size > offset) {
+            length = st.st_size - offset;
+        }
+    }
+
+    sf  = poll_event_newctx(L, ev, sendfile_handler, sizeof(sendfile_t));
+    *sf = (sendfile_t){
+        .fd        = fd,
+        .offset    = offset,
+        .remain    = length,
+        .sendflags = poll_sendflags(ev->reg_evt.ident),
+    };
+    // the job is advanced when the descriptor becomes writable
+    if (!ev->enabled && poll_watch_event(L, ev, 1) != POLL_OK) {
+        int err = errno;
+        poll_event_delctx(L, ev);
+        errno = err;
+        goto FAIL;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+
+FAIL:
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, strerror(errno));
+    lua_pushinteger(L, errno);
+    return 3;
+}
+
+static int pending_lua(lua_State *L)
+{
+    poll_event_t *ev = luaL_checkudata(L, 1, MODULE_MT);
+
+    if (ev->handler == writeq_handler) {
+        lua_pushinteger(L, ((writeq_t *)ev->ctx)->nbyte);
+    } else if (ev->handler == sendfile_handler) {
+        lua_pushinteger(L, ((sendfile_t *)ev->ctx)->remain);
+    } else {
+        lua_pushinteger(L, 0);
+    }
+    return 1;
+}
+
+static int watermark_lua(lua_State *L)
+{
+    poll_event_t *ev   = luaL_checkudata(L, 1, MODULE_MT);
+    lua_Integer lowat = luaL_optinteger(L, 2, 0);
+    lua_Integer hiwat = luaL_optinteger(L, 3, 0);
+    writeq_t *wq       = NULL;
+
+    luaL_argcheck(L, lowat >= 0, 2, "lowat must be >= 0");
+    luaL_argcheck(L, hiwat == 0 || hiwat >= lowat, 3,
+                  "hiwat must be 0 or >= lowat");
+
+    wq = writeq_get(L, ev);
+    if (!wq) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, strerror(errno));
+        lua_pushinteger(L, errno);
+        return 3;
+    }
+    wq->lowat = lowat;
+    wq->hiwat = hiwat;
+    wq->above = hiwat && wq->nbyte > (size_t)hiwat;
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 // static int data_lua(lua_State *L)
 // {
 //     return poll_event_data_lua(L, MODULE_MT);
@@ -70,6 +710,16 @@
 //     return 1;
 // }
 
+static int mark_ready_lua(lua_State *L)
+{
+    return poll_event_mark_ready_lua(L, MODULE_MT);
+}
+
+static int idle_timeout_lua(lua_State *L)
+{
+    return poll_event_idle_timeout_lua(L, MODULE_MT);
+}
+
 static int getinfo_lua(lua_State *L)
 {
     return poll_event_getinfo_lua(L, MODULE_MT);
@@ -125,6 +775,11 @@ static int is_enabled_lua(lua_State *L)
     return poll_event_is_enabled_lua(L, MODULE_MT);
 }
 
+static int modify_lua(lua_State *L)
+{
+    return poll_event_modify_lua(L, MODULE_MT);
+}
+
 static int unwatch_lua(lua_State *L)
 {
     return poll_event_unwatch_lua(L, MODULE_MT);
@@ -192,23 +847,31 @@ void libopen_poll_write(lua_State *L)
         {NULL,         NULL        }
     };
     struct luaL_Reg method[] = {
-        {"type",       type_lua      },
-        {"renew",      renew_lua     },
-        {"revert",     revert_lua    },
-        {"watch",      watch_lua     },
-        {"unwatch",    unwatch_lua   },
-        {"is_enabled", is_enabled_lua},
-        {"is_eof",     is_eof_lua    },
-        {"is_level",   is_level_lua  },
-        {"as_level",   as_level_lua  },
-        {"is_edge",    is_edge_lua   },
-        {"as_edge",    as_edge_lua   },
-        {"is_oneshot", is_oneshot_lua},
-        {"as_oneshot", as_oneshot_lua},
-        {"ident",      ident_lua     },
-        {"udata",      udata_lua     },
-        {"getinfo",    getinfo_lua   },
-        {NULL,         NULL          }
+        {"type",         type_lua        },
+        {"renew",        renew_lua       },
+        {"revert",       revert_lua      },
+        {"watch",        watch_lua       },
+        {"unwatch",      unwatch_lua     },
+        {"modify",       modify_lua      },
+        {"is_enabled",   is_enabled_lua  },
+        {"is_eof",       is_eof_lua      },
+        {"is_level",     is_level_lua    },
+        {"as_level",     as_level_lua    },
+        {"is_edge",      is_edge_lua     },
+        {"as_edge",      as_edge_lua     },
+        {"is_oneshot",   is_oneshot_lua  },
+        {"as_oneshot",   as_oneshot_lua  },
+        {"ident",        ident_lua       },
+        {"udata",        udata_lua       },
+        {"idle_timeout", idle_timeout_lua},
+        {"mark_ready",   mark_ready_lua  },
+        {"getinfo",      getinfo_lua     },
+        {"enqueue",      enqueue_lua     },
+        {"enqueue_msg",  enqueue_msg_lua },
+        {"sendfile",     sendfile_lua    },
+        {"pending",      pending_lua     },
+        {"watermark",    watermark_lua   },
+        {NULL,           NULL            }
     };
 
     // create metatable
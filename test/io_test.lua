@@ -0,0 +1,75 @@
+local testcase = require('testcase')
+local kqueue = require('kqueue')
+local fileno = require('io.fileno')
+
+if not kqueue.usable() then
+    return
+end
+
+local TMPFILE
+local TMPFD
+
+function testcase.before_each()
+    if TMPFILE then
+        TMPFILE:close()
+        TMPFILE = nil
+        TMPFD = nil
+    end
+
+    TMPFILE = assert(io.tmpfile())
+    TMPFD = fileno(TMPFILE)
+end
+
+function testcase.type()
+    local kq = assert(kqueue.new())
+    local ev = kq:new_event()
+    assert(ev:as_io(TMPFD, 'rw'))
+
+    -- test that get the event type
+    assert.equal(ev:type(), 'io')
+    assert.equal(#kq, 2)
+end
+
+function testcase.revert()
+    local kq = assert(kqueue.new())
+    local ev = kq:new_event()
+    assert(ev:as_io(TMPFD, 'r'))
+    assert.match(ev, '^kqueue%.io: ', false)
+
+    -- test that revert event to initial state
+    assert(ev:revert())
+    assert.match(ev, '^kqueue%.event: ', false)
+    assert.equal(#kq, 0)
+end
+
+function testcase.readiness()
+    local kq = assert(kqueue.new())
+    local ev = kq:new_event()
+    assert(ev:as_io(TMPFD, 'rw', 'context'))
+
+    -- test that both directions are merged into a single result
+    TMPFILE:write('test')
+    TMPFILE:seek('set')
+    assert.equal(assert(kq:wait()), 2)
+    local oev, udata, disabled = kq:consume()
+    assert.equal(oev, ev)
+    assert.equal(udata, 'context')
+    assert.is_nil(disabled)
+    assert.equal(ev:readiness(), 'rw')
+    assert.is_nil(kq:consume())
+
+    -- test that change the interest
+    assert.equal(ev:mask('w'), 'rw')
+    assert.equal(ev:mask(), 'w')
+    assert.equal(assert(kq:wait()), 1)
+    assert.equal(kq:consume(), ev)
+    assert.equal(ev:readiness(), 'w')
+
+    -- test that no event occurs if no interest
+    assert.equal(ev:mask(''), 'w')
+    assert.equal(assert(kq:wait(0.01)), 0)
+
+    -- test that throws an error if invalid mask
+    local err = assert.throws(ev.mask, ev, 'x')
+    assert.match(err, "mask must be 'r', 'w' or 'rw'")
+end
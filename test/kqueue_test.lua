@@ -2,6 +2,8 @@ local testcase = require('testcase')
 local kqueue = require('kqueue')
 local fileno = require('io.fileno')
 local pipe = require('os.pipe.io')
+local socket = require('socket')
+local unix = require('socket.unix')
 
 if not kqueue.usable() then
     function testcase.usable()
@@ -21,6 +23,21 @@ end
 local TMPFILE
 local TMPFD
 
+-- connected pair of the unix domain stream sockets
+local function socketpair()
+    local path = os.tmpname()
+    os.remove(path)
+    local srv = assert(unix())
+    assert(srv:bind(path))
+    assert(srv:listen())
+    local c = assert(unix())
+    assert(c:connect(path))
+    local s = assert(srv:accept())
+    srv:close()
+    os.remove(path)
+    return c, s
+end
+
 function testcase.before_each()
     if TMPFILE then
         TMPFILE:close()
@@ -107,6 +124,22 @@ function testcase.wait()
     assert(TMPFILE:seek('set'))
     nevt = assert(kq:wait())
     assert.equal(nevt, 1)
+
+    -- test that receive events up to maxevents
+    local ev2 = kq:new_event()
+    assert(ev2:as_write(TMPFD))
+    nevt = assert(kq:wait(nil, 1))
+    assert.equal(nevt, 1)
+    nevt = assert(kq:wait(nil, 0))
+    assert.equal(nevt, 2)
+    nevt = assert(kq:poll(1))
+    assert.equal(nevt, 1)
+
+    -- test that throws an error if maxevents is negative
+    local err = assert.throws(function()
+        kq:wait(nil, -1)
+    end)
+    assert.match(err, 'maxevents must be >= 0')
 end
 
 function testcase.unconsumed_events_will_be_consumed_in_wait()
@@ -281,3 +314,795 @@ function testcase.edge_triggered_event_will_not_repeat()
     assert.equal(assert(kq:wait()), 1)
 end
 
+
+function testcase.relay()
+    local kq = assert(kqueue.new())
+    local f = assert(io.tmpfile())
+    local fd = fileno(f)
+
+    -- test that relay two descriptors
+    local rel = assert(kq:relay(TMPFD, fd, {
+        bufsize = 1024,
+        udata = 'context',
+    }))
+    assert.match(rel, '^kqueue%.relay: ', false)
+    assert.equal(rel:type(), 'relay')
+    assert.equal(rel:udata(), 'context')
+    assert.equal({
+        rel:nbyte(),
+    }, {
+        0,
+        0,
+    })
+    assert.is_true(rel:is_enabled())
+    assert.equal(#kq, 4)
+
+    -- test that return error if descriptor is already watched
+    local ev = kq:new_event()
+    local _, err = ev:as_read(TMPFD)
+    assert.match(err, 'exists')
+
+    -- test that unwatch all registrations of the relay
+    assert(rel:unwatch())
+    assert.is_false(rel:is_enabled())
+    assert.equal(#kq, 0)
+
+    -- test that return error if descriptors are same
+    rel, err = kq:relay(fd, fd)
+    assert.is_nil(rel)
+    assert.match(err, 'Invalid argument')
+    f:close()
+
+    -- test that throws an error if invalid bufsize
+    err = assert.throws(function()
+        kq:relay(0, 1, {
+            bufsize = 0,
+        })
+    end)
+    assert.match(err, 'bufsize must be integer > 0')
+end
+
+function testcase.fd_and_poll()
+    local parent = assert(kqueue.new())
+    local child = assert(kqueue.new())
+    local ev = child:new_event()
+    assert(ev:as_timer(1, 0.01))
+
+    -- test that return the kqueue descriptor
+    local fd = child:fd()
+    assert.is_int(fd)
+    assert.not_equal(fd, parent:fd())
+
+    -- test that return 0 without blocking if no events are ready
+    assert.equal(assert(child:poll()), 0)
+
+    -- test that child kqueue descriptor can be watched by parent
+    local pev = parent:new_event()
+    assert(pev:as_read(fd, 'child'))
+    assert.equal(assert(parent:wait(1)), 1)
+    local oev, udata = parent:consume()
+    assert.equal(oev, pev)
+    assert.equal(udata, 'child')
+    assert.equal(assert(child:poll()), 1)
+    assert.equal(child:consume(), ev)
+end
+
+function testcase.renew_registers_watched_events()
+    local kq = assert(kqueue.new())
+    local ev1 = kq:new_event()
+    assert(ev1:as_write(TMPFD))
+    local ev2 = kq:new_event()
+    assert(ev2:as_timer(1, 0.01))
+    assert(ev2:unwatch())
+
+    -- test that watched events are registered to the new descriptor
+    assert(kq:renew())
+    assert.is_true(ev1:is_enabled())
+    assert.is_false(ev2:is_enabled())
+    assert.equal(#kq, 1)
+    assert.equal(assert(kq:wait()), 1)
+    assert.equal(kq:consume(), ev1)
+end
+
+function testcase.migrate()
+    local kq1 = assert(kqueue.new())
+    local kq2 = assert(kqueue.new())
+    local rev = kq1:new_event()
+    assert(rev:as_read(TMPFD, 'read'))
+    local wev = kq1:new_event()
+    assert(wev:as_write(TMPFD, 'write'))
+    local tev = kq1:new_event()
+    assert(tev:as_timer(1, 1.0, 'timer'))
+    assert(TMPFILE:write('test'))
+    assert(TMPFILE:seek('set'))
+
+    -- test that move the events by filter name
+    assert.equal(assert(kq1:migrate(kq2, 'read')), 1)
+    assert.equal(#kq1, 2)
+    assert.equal(#kq2, 1)
+    assert.equal(assert(kq2:wait()), 1)
+    assert.equal(kq2:consume(), rev)
+
+    -- test that move the events by predicate
+    assert.equal(assert(kq1:migrate(kq2, function(_, udata)
+        return udata == 'write'
+    end)), 1)
+    assert.equal(#kq1, 1)
+    assert.equal(#kq2, 2)
+
+    -- test that move the events by list
+    assert.equal(assert(kq2:migrate(kq1, {
+        rev,
+        wev,
+        rev,
+        tev,
+    })), 2)
+    assert.equal(#kq1, 3)
+    assert.equal(#kq2, 0)
+    assert(rev:unwatch())
+    assert.equal(#kq1, 2)
+
+    -- test that return error if ident is already registered in target
+    local ev = kq2:new_event()
+    assert(ev:as_timer(1, 1.0))
+    local n, err, errnum = kq1:migrate(kq2, 'timer')
+    assert.equal(n, 0)
+    assert.match(err, 'exists')
+    assert.is_int(errnum)
+
+    -- test that throws an error if invalid selector
+    err = assert.throws(function()
+        kq1:migrate(kq2, 1)
+    end)
+    assert.match(err, 'string, function or table expected')
+    err = assert.throws(function()
+        kq1:migrate(kq2, {
+            'foo',
+        })
+    end)
+    assert.match(err, 'list of events expected')
+end
+
+function testcase.migrate_marked_event()
+    local kq1 = assert(kqueue.new())
+    local kq2 = assert(kqueue.new())
+    local p = assert(pipe())
+    local ev = kq1:new_event()
+    assert(ev:as_read(p.reader:fd()))
+    assert(p:write('x'))
+    assert.equal(assert(kq1:wait(1)), 1)
+    assert.equal(kq1:consume(), ev)
+    assert(p.reader:read(1))
+
+    -- test that the marked event is delivered by the target only
+    assert.is_true(ev:mark_ready())
+    assert.equal(assert(kq1:migrate(kq2, {
+        ev,
+    })), 1)
+    assert.equal(assert(kq1:wait(0)), 0)
+    assert.is_nil(kq1:consume())
+    assert.equal(assert(kq2:wait(0)), 1)
+    assert.equal(kq2:consume(), ev)
+    assert.is_nil(kq2:consume())
+end
+
+function testcase.migrate_rollback_keeps_idle_timer()
+    local kq1 = assert(kqueue.new())
+    local kq2 = assert(kqueue.new())
+    local p = assert(pipe())
+    local ev = kq1:new_event()
+    assert(ev:as_read(p.reader:fd()))
+    ev:idle_timeout(0.05)
+    p.reader:close()
+
+    -- test that the event that cannot be registered to the target remains
+    -- in the source with its idle timer
+    local n, err = kq1:migrate(kq2, {
+        ev,
+    })
+    assert.equal(n, 0)
+    assert.equal(type(err), 'string')
+    assert.equal(#kq1, 1)
+    assert.equal(#kq2, 0)
+    assert.equal(assert(kq1:wait(1)), 1)
+    local oev, _, _, _, terr = kq1:consume()
+    assert.equal(oev, ev)
+    assert.match(terr, 'timed out')
+
+    -- test that the idle timer is removed when the event is unwatched
+    ev:unwatch()
+    ev = nil
+    collectgarbage()
+    collectgarbage()
+    assert.equal(assert(kq1:wait(0.1)), 0)
+end
+
+function testcase.limit_and_memory()
+    local kq = assert(kqueue.new())
+    local ev1 = kq:new_event()
+    local ev2 = kq:new_event()
+
+    -- test that return the memory usage
+    local usage, nreg = kq:memory()
+    assert.equal(usage.evlist, 0)
+    assert.equal(usage.events, 0)
+    assert.equal(usage.ctx, 0)
+    assert.equal(usage.queues, 0)
+    assert.equal(usage.idle, 0)
+    assert.equal(usage.total, usage.kqueue)
+    assert.equal(nreg, {
+        read = 0,
+        write = 0,
+        signal = 0,
+        timer = 0,
+        user = 0,
+    })
+
+    -- test that watch fails if registrations exceed the limit
+    assert(kq:limit({
+        timer = 1,
+        evlist = 1,
+    }))
+    assert(ev1:as_timer(1, 0.01))
+    local ev, err, errnum = ev2:as_timer(2, 0.01)
+    assert.is_nil(ev)
+    assert.match(err, 'buffer')
+    assert.is_int(errnum)
+    assert(ev2:as_read(TMPFD))
+    usage, nreg = kq:memory()
+    assert.greater(usage.events, 0)
+    assert.equal(nreg.timer, 1)
+    assert.equal(nreg.read, 1)
+
+    -- test that event list does not exceed the limit
+    assert.equal(assert(kq:wait()), 1)
+    usage = kq:memory()
+    assert.greater(usage.evlist, 0)
+    assert.equal(usage.total,
+                 usage.kqueue + usage.evlist + usage.events + usage.evsets +
+                     usage.ctx + usage.queues + usage.idle)
+
+    -- test that the buffers of the event context are counted
+    local kq2 = assert(kqueue.new())
+    local f = assert(io.tmpfile())
+    assert(kq2:relay(TMPFD, fileno(f), {
+        bufsize = 1024,
+    }))
+    usage = kq2:memory()
+    assert.greater(usage.ctx, 1024 * 2)
+
+    -- test that throws an error if invalid limit
+    err = assert.throws(function()
+        kq:limit({
+            read = -1,
+        })
+    end)
+    assert.match(err, 'read must be integer between 0 and')
+    err = assert.throws(function()
+        kq:limit({
+            evlist = 0x80000000,
+        })
+    end)
+    assert.match(err, 'evlist must be integer between 0 and')
+end
+
+function testcase.submit()
+    local kq = assert(kqueue.new())
+
+    -- test that completions of the jobs are delivered by consume
+    local job1 = assert(kq:submit('sleep', 0.01, 'job1'))
+    local job2 = assert(kq:submit('sleep', 0.02))
+    assert.equal(job1:type(), 'job')
+    assert.is_true(job1:is_enabled())
+    local done = {}
+    while not (done[job1] and done[job2]) do
+        assert(kq:wait(1))
+        local ev, udata, disabled, _, err = kq:consume()
+        while ev do
+            assert.is_true(disabled)
+            assert.is_nil(err)
+            done[ev] = udata or true
+            ev, udata, disabled, _, err = kq:consume()
+        end
+    end
+    assert.equal(done[job1], 'job1')
+    assert.is_false(job1:is_enabled())
+    assert.is_nil(job1:result())
+
+    -- test that the internal event of the job completion is not counted as
+    -- a registration
+    assert.equal(#kq, 0)
+    assert.equal(kq:wait(0), 0)
+    assert(kq:limit({
+        read = 1,
+    }))
+    local p = assert(pipe())
+    assert(kq:new_event():as_read(p.reader:fd()))
+    assert.equal(#kq, 1)
+    assert(kq:limit({
+        read = 0,
+    }))
+
+    -- test that the failure of the job is delivered with errno
+    local job = assert(kq:submit('sleep', -1))
+    local ev, _, disabled, eof, err, errnum
+    repeat
+        assert(kq:wait(1))
+        ev, _, disabled, eof, err, errnum = kq:consume()
+    until ev
+    assert.equal(ev, job)
+    assert.is_true(disabled)
+    assert.is_nil(eof)
+    assert.match(err, 'invalid')
+    assert.is_int(errnum)
+
+    -- test that throws an error if unknown job
+    err = assert.throws(kq.submit, kq, 'unknown')
+    assert.match(err, 'unknown job unknown')
+
+    -- test that the job function must be passed as a lightuserdata
+    err = assert.throws(kqueue.register_job, 'unknown', function()
+    end)
+    assert.match(err, 'lightuserdata expected')
+end
+
+function testcase.file_read_write()
+    local kq = assert(kqueue.new())
+    local wait_job = function(job)
+        repeat
+            assert(kq:wait(1))
+            local ev, udata, _, _, err = kq:consume()
+            if ev then
+                assert.equal(ev, job)
+                assert.is_nil(err)
+                return udata
+            end
+        until false
+    end
+
+    -- test that write data at the offset
+    local job = assert(kq:file_write(TMPFD, 2, 'hello', 'w'))
+    assert.equal(wait_job(job), 'w')
+    assert.equal(job:result(), 5)
+
+    -- test that read data from the offset
+    job = assert(kq:file_read(TMPFD, 2, 5, 'r'))
+    assert.equal(wait_job(job), 'r')
+    assert.equal(job:result(), 'hello')
+
+    -- test that short data is returned at the end of file
+    job = assert(kq:file_read(TMPFD, 4, 100))
+    wait_job(job)
+    assert.equal(job:result(), 'llo')
+
+    -- test that throws an error if invalid offset
+    local err = assert.throws(kq.file_read, kq, TMPFD, -1, 1)
+    assert.match(err, 'offset must be >= 0')
+end
+
+function testcase.consume_until()
+    local kq = assert(kqueue.new())
+    local ev1 = kq:new_event()
+    assert(ev1:as_oneshot())
+    assert(ev1:as_write(TMPFD))
+    local ev2 = kq:new_event()
+    assert(ev2:as_oneshot())
+    assert(ev2:as_timer(1, 0.01))
+    local p = assert(pipe())
+    assert(p:write('test'))
+    local ev3 = kq:new_event()
+    assert(ev3:as_oneshot())
+    assert(ev3:as_read(p.reader:fd()))
+    assert.equal(assert(kq:wait(0)), 2)
+
+    -- test that return nil if deadline is reached
+    assert.is_nil(kq:consume_until(kqueue.clock() - 1))
+
+    -- test that the remaining events are kept and the timer event that
+    -- occurs later is delivered first
+    local t = kqueue.clock() + 0.02
+    repeat
+    until kqueue.clock() > t
+    assert.equal(assert(kq:wait()), 3)
+    assert.equal(kq:consume(), ev2)
+    local list = {}
+    for _ = 1, 2 do
+        list[assert(kq:consume_until(kqueue.clock() + 1))] = true
+    end
+    assert.equal(list, {
+        [ev1] = true,
+        [ev3] = true,
+    })
+    assert.is_nil(kq:consume())
+
+    -- test that the level-triggered event that is returned again by the
+    -- kernel is not delivered twice
+    local ev4 = assert(kq:new_event():as_read(p.reader:fd()))
+    assert(p:write('test'))
+    assert.equal(assert(kq:wait(0)), 1)
+    assert.is_nil(kq:consume_until(kqueue.clock() - 1))
+    assert.equal(assert(kq:wait(0)), 1)
+    assert.equal(kq:consume(), ev4)
+    assert.is_nil(kq:consume())
+
+    -- test that throws an error if invalid deadline
+    local err = assert.throws(kq.consume_until, kq)
+    assert.match(err, 'number expected')
+end
+
+function testcase.export_import()
+    local kq = assert(kqueue.new())
+    local ev = kq:new_event()
+    assert(ev:as_timer(1, 1, 'timer'))
+    local p = assert(pipe())
+
+    -- test that return error if descriptor is not a socket
+    local n, err, errnum = kq:export(p.writer:fd())
+    assert.is_nil(n)
+    assert.match(err, 'socket')
+    assert.is_int(errnum)
+
+    local list
+    list, err, errnum = kq:import(p.reader:fd())
+    assert.is_nil(list)
+    assert.match(err, 'socket')
+    assert.is_int(errnum)
+
+    -- test that hand off the events to the other kqueue instance
+    local c, s = socketpair()
+    local rev = assert(kq:new_event():as_read(p.reader:fd(), 'reader'))
+    assert.equal(assert(kq:export(c:getfd())), 2)
+    assert.is_true(rev:is_enabled())
+    local kq2 = assert(kqueue.new())
+    list = assert(kq2:import(s:getfd()))
+    c:close()
+    s:close()
+    assert.equal(#list, 2)
+    local evs = {}
+    for _, v in ipairs(list) do
+        assert.is_true(v:is_enabled())
+        evs[v:udata()] = v
+    end
+    assert.equal(evs.timer:type(), 'timer')
+    assert.equal(evs.timer:ident(), ev:ident())
+    assert.equal(evs.reader:type(), 'read')
+    -- the descriptor is passed by SCM_RIGHTS
+    assert.not_equal(evs.reader:ident(), p.reader:fd())
+
+    -- test that the received descriptor is watched by the successor
+    assert(p:write('hello'))
+    assert.equal(assert(kq2:wait(0)), 1)
+    assert.equal(kq2:consume(), evs.reader)
+end
+
+function testcase.export_import_shared_descriptor()
+    local kq = assert(kqueue.new())
+    local a, b = socketpair()
+    assert(kq:new_event():as_read(a:getfd(), 'reader'))
+    assert(kq:new_event():as_write(a:getfd(), 'writer'))
+
+    -- test that the descriptor of the read and write events is passed once
+    local c, s = socketpair()
+    assert.equal(assert(kq:export(c:getfd())), 2)
+    local kq2 = assert(kqueue.new())
+    local list = assert(kq2:import(s:getfd()))
+    c:close()
+    s:close()
+    assert.equal(#list, 2)
+    local evs = {}
+    for _, v in ipairs(list) do
+        evs[v:udata()] = v
+    end
+    assert.equal(evs.reader:ident(), evs.writer:ident())
+    assert.not_equal(evs.reader:ident(), a:getfd())
+
+    -- test that close_fd() drops both events of the shared descriptor
+    assert(kq2:close_fd(evs.reader:ident()))
+    assert.is_false(evs.reader:is_enabled())
+    assert.is_false(evs.writer:is_enabled())
+    assert.equal(#kq2, 0)
+    a:close()
+    b:close()
+end
+
+function testcase.defer()
+    local kq = assert(kqueue.new())
+    local ev = kq:new_event()
+    assert(ev:as_timer(1, 1))
+    local calls = {}
+
+    -- test that deferred functions are called by the next wait in order
+    assert.is_true(kq:defer(function(...)
+        calls[#calls + 1] = {
+            ...,
+        }
+        -- deferred by deferred function
+        kq:defer(function()
+            calls[#calls + 1] = 'next'
+        end)
+    end, 'a', 'b'))
+    assert(kq:defer(function(v)
+        calls[#calls + 1] = v
+    end, 'c'))
+    assert.equal(calls, {})
+    -- NOTE: wait does not block until the timer expires
+    assert.equal(assert(kq:wait()), 0)
+    assert.equal(calls, {
+        {
+            'a',
+            'b',
+        },
+        'c',
+    })
+    assert.equal(assert(kq:poll()), 0)
+    assert.equal(calls[3], 'next')
+
+    -- test that the function is called with many arguments
+    local args = {}
+    for i = 1, 200 do
+        args[i] = i
+    end
+    local nargs
+    assert(kq:defer(function(...)
+        nargs = select('#', ...)
+    end, (unpack or table.unpack)(args)))
+    assert.equal(assert(kq:poll()), 0)
+    assert.equal(nargs, 200)
+
+    -- test that throws an error if fn is not a function
+    local err = assert.throws(kq.defer, kq, 'foo')
+    assert.match(err, 'function expected')
+end
+
+function testcase.watch_many()
+    local kq = assert(kqueue.new())
+    local p = assert(pipe())
+    local ev = kq:new_event()
+    assert(ev:as_timer(nil, 0.01, 'timer'))
+    assert(ev:unwatch())
+
+    -- test that register events and specs at once
+    local evs, errs = kq:watch_many({
+        {
+            'read',
+            p.reader:fd(),
+            'read',
+        },
+        {
+            'write',
+            p.writer:fd(),
+            'write',
+            trigger = 'edge',
+        },
+        {
+            'user',
+            nil,
+            'user',
+            trigger = 'oneshot',
+        },
+        ev,
+    })
+    assert.is_nil(errs)
+    assert.equal(#evs, 4)
+    assert.equal(evs[1]:type(), 'read')
+    assert.equal(evs[1]:udata(), 'read')
+    assert.equal(evs[2]:type(), 'write')
+    assert.is_true(evs[2]:is_edge())
+    assert.equal(evs[3]:type(), 'user')
+    assert.is_true(evs[3]:is_oneshot())
+    assert.equal(evs[4], ev)
+    for _, v in ipairs(evs) do
+        assert.is_true(v:is_enabled())
+    end
+    assert.equal(#kq, 4)
+
+    -- test that the failed entry is reported at the same index
+    evs, errs = kq:watch_many({
+        {
+            'io',
+            p.reader:fd(),
+            'rw',
+        },
+        ev,
+    })
+    assert.equal(#evs, 2)
+    assert.is_false(evs[1]:is_enabled())
+    assert.is_int(errs[1])
+    assert.is_int(errs[2])
+    assert.equal(#kq, 4)
+
+    -- test that throws an error if spec is invalid
+    local err = assert.throws(kq.watch_many, kq, {
+        {
+            'foo',
+        },
+    })
+    assert.match(err, 'unknown type')
+    err = assert.throws(kq.watch_many, kq, {
+        'foo',
+    })
+    assert.match(err, 'list of events or specs expected')
+    err = assert.throws(kq.watch_many, kq, {
+        {
+            'user',
+            nil,
+            trigger = 'foo',
+        },
+    })
+    assert.match(err, 'trigger')
+end
+
+function testcase.close_fd()
+    local kq = assert(kqueue.new())
+    local p = assert(pipe())
+    local fd = p.reader:fd()
+    local rev = assert(kq:new_event():as_read(fd, 'read'))
+    local wev = assert(kq:new_event():as_write(p.writer:fd(), 'write'))
+    assert(p:write('hello'))
+    assert.equal(#kq, 2)
+
+    -- test that close the descriptor and drop its pending events
+    assert.equal(assert(kq:wait(0)), 2)
+    assert.is_true(kq:close_fd(fd))
+    assert.is_false(rev:is_enabled())
+    assert.is_true(wev:is_enabled())
+    assert.equal(#kq, 1)
+    local ev = assert(kq:consume())
+    assert.equal(ev, wev)
+    assert.is_nil(kq:consume())
+
+    -- test that drop the event that is marked as still ready
+    local p2 = assert(pipe())
+    local ev2 = assert(kq:new_event():as_read(p2.reader:fd()))
+    assert.is_true(ev2:mark_ready())
+    assert.is_true(kq:close_fd(p2.reader:fd()))
+    assert.equal(assert(kq:wait(0)), 1)
+    assert.equal(kq:consume(), wev)
+    assert.is_nil(kq:consume())
+
+    -- test that drop the event in the ready queue
+    local p3 = assert(pipe())
+    local ev3 = assert(kq:new_event():as_read(p3.reader:fd()))
+    assert.is_true(ev3:mark_ready())
+    assert.equal(assert(kq:wait(0)), 2)
+    assert.is_true(kq:close_fd(p3.reader:fd()))
+    assert.equal(kq:consume(), wev)
+    assert.is_nil(kq:consume())
+
+    -- test that the operation in progress is delivered as canceled
+    local p4 = assert(pipe(true))
+    local op = assert(kq:async_read(p4.reader:fd(), 10, 'read'))
+    assert.is_true(kq:close_fd(p4.reader:fd()))
+    assert.is_false(op:is_enabled())
+    assert.equal(assert(kq:wait(0)), 2)
+    assert.equal(kq:consume(), wev)
+    local udata, disabled, eof, errmsg, errno
+    ev, udata, disabled, eof, errmsg, errno = kq:consume()
+    assert.equal(ev, op)
+    assert.equal(udata, 'read')
+    assert.is_true(disabled)
+    assert.is_nil(eof)
+    assert.match(errmsg, 'cancel')
+    assert.is_int(errno)
+    assert.is_nil(kq:consume())
+
+    -- test that return error if descriptor is already closed
+    local ok, err, errnum = kq:close_fd(fd)
+    assert.is_false(ok)
+    assert.match(err, 'Bad file descriptor')
+    assert.is_int(errnum)
+end
+
+function testcase.async_ops()
+    local kq = assert(kqueue.new())
+    -- non-blocking pipe
+    local p = assert(pipe(true))
+
+    -- test that the operation is completed on readiness
+    local op = assert(kq:async_read(p.reader:fd(), 10, 'read'))
+    assert.equal(op:type(), 'op')
+    assert.is_true(op:is_enabled())
+    assert.equal(#kq, 1)
+    assert(p:write('hello'))
+    assert.equal(assert(kq:wait(0)), 1)
+    local ev, udata, disabled = kq:consume()
+    assert.equal(ev, op)
+    assert.equal(udata, 'read')
+    assert.is_true(disabled)
+    assert.is_false(op:is_enabled())
+    assert.equal(op:result(), 'hello')
+    assert.equal(#kq, 0)
+
+    -- test that the operation that can be completed immediately is
+    -- delivered without registration
+    op = assert(kq:async_write(p.writer:fd(), 'world', 'write'))
+    assert.is_false(op:is_enabled())
+    assert.equal(#kq, 0)
+    assert.equal(assert(kq:wait(0)), 1)
+    ev, udata, disabled = kq:consume()
+    assert.equal(ev, op)
+    assert.equal(udata, 'write')
+    assert.is_true(disabled)
+    assert.equal(op:result(), 5)
+    op = assert(kq:async_read(p.reader:fd(), 10))
+    assert.equal(assert(kq:wait(0)), 1)
+    assert.equal(kq:consume(), op)
+    assert.equal(op:result(), 'world')
+
+    -- test that the pending operation can be cancelled
+    op = assert(kq:async_read(p.reader:fd(), 10))
+    assert.is_true(op:cancel())
+    assert.is_false(op:cancel())
+    assert.equal(#kq, 0)
+
+    -- test that the error is delivered through consume
+    op = assert(kq:async_write(p.reader:fd() + 1000, 'foo'))
+    assert.equal(assert(kq:wait(0)), 1)
+    local eof, err, errnum
+    ev, udata, disabled, eof, err, errnum = kq:consume()
+    assert.equal(ev, op)
+    assert.is_true(disabled)
+    assert.is_nil(eof)
+    assert.match(err, 'Bad file descriptor')
+    assert.is_int(errnum)
+end
+
+function testcase.async_accept_connect()
+    local kq = assert(kqueue.new())
+    local srv = assert(socket.bind('127.0.0.1', 0))
+    local ip, port = srv:getsockname()
+
+    -- test that the accept operation waits for the connection
+    local aop = assert(kq:async_accept(srv:getfd(), 'accept'))
+    assert.is_true(aop:is_enabled())
+
+    -- test that the connect operation waits for the connection in progress
+    local c = assert(socket.tcp())
+    assert(c:settimeout(0))
+    local ok, err = c:connect(ip, port)
+    if not ok then
+        assert.equal(err, 'timeout')
+    end
+    local cop = assert(kq:async_connect(c:getfd(), 'connect'))
+
+    -- test that the completions are delivered
+    local done = {}
+    for _ = 1, 10 do
+        if done.accept and done.connect then
+            break
+        end
+        assert(kq:wait(1))
+        local ev, udata, disabled, eof, cerr = kq:consume()
+        while ev do
+            assert.is_true(disabled)
+            assert.is_nil(eof)
+            assert.is_nil(cerr)
+            done[udata] = ev
+            ev, udata, disabled, eof, cerr = kq:consume()
+        end
+    end
+    assert.equal(done.accept, aop)
+    assert.equal(done.connect, cop)
+    assert.is_true(cop:result())
+    local fd = aop:result()
+    assert.is_int(fd)
+    assert(kq:close_fd(fd))
+
+    -- test that the accepted descriptor is closed if it is never retrieved
+    local c2 = assert(socket.connect(ip, port))
+    aop = assert(kq:async_accept(srv:getfd()))
+    assert(kq:wait(1))
+    assert.equal(kq:consume(), aop)
+    aop = nil
+    collectgarbage()
+    collectgarbage()
+    assert(c2:settimeout(1))
+    local data
+    data, err = c2:receive(1)
+    assert.is_nil(data)
+    assert.equal(err, 'closed')
+
+    c2:close()
+    c:close()
+    srv:close()
+end
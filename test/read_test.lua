@@ -2,6 +2,8 @@ local testcase = require('testcase')
 local kqueue = require('kqueue')
 local fileno = require('io.fileno')
 local errno = require('errno')
+local pipe = require('os.pipe.io')
+local socket = require('socket')
 
 if not kqueue.usable() then
     return
@@ -108,6 +110,185 @@ function testcase.watch_unwatch()
     assert.is_nil(errnum)
 end
 
+function testcase.modify()
+    local kq = assert(kqueue.new())
+    local ev = kq:new_event()
+    assert(TMPFILE:write('test'))
+    TMPFILE:seek('set')
+    assert(ev:as_read(TMPFD))
+
+    -- test that switch the enabled event to edge-triggered
+    assert(ev:modify({
+        trigger = 'edge',
+    }))
+    assert.is_true(ev:is_enabled())
+    assert.is_true(ev:is_edge())
+    assert.equal(#kq, 1)
+    assert.equal(assert(kq:wait()), 1)
+    assert.equal(kq:consume(), ev)
+    assert.equal(assert(kq:wait(0.01)), 0)
+
+    -- test that throws an error if opts is not table
+    local err = assert.throws(function()
+        ev:modify('edge')
+    end)
+    assert.match(err, 'table expected')
+end
+
+function testcase.accept()
+    local kq = assert(kqueue.new())
+    local ev = kq:new_event()
+    assert(ev:as_read(TMPFD))
+
+    -- test that return error with accepted list if descriptor is not a socket
+    local list, err, errnum = ev:accept(1)
+    assert.equal(list, {})
+    assert.equal(err, errno.ENOTSOCK.message)
+    assert.equal(errnum, errno.ENOTSOCK.code)
+
+    -- test that throws an error if invalid template
+    err = assert.throws(function()
+        ev:accept(1, {
+            filter = 'signal',
+        })
+    end)
+    assert.match(err, 'invalid option')
+    err = assert.throws(function()
+        ev:accept(1, {
+            trigger = 'invalid',
+        })
+    end)
+    assert.match(err, 'invalid trigger invalid')
+
+    -- test that accept the connections from the loopback listener
+    local srv = assert(socket.bind('127.0.0.1', 0))
+    local ip, port = srv:getsockname()
+    local clients = {}
+    for i = 1, 3 do
+        clients[i] = assert(socket.connect(ip, port))
+    end
+    local kq2 = assert(kqueue.new())
+    ev = assert(kq2:new_event():as_read(srv:getfd()))
+
+    -- test that accept a single connection if no event has occurred yet
+    list, err = ev:accept()
+    assert.is_nil(err)
+    assert.equal(#list, 1)
+    assert.is_int(list[1])
+
+    -- test that accept the pending connections reported by the event
+    assert.equal(assert(kq2:wait(1)), 1)
+    assert.equal(kq2:consume(), ev)
+    local list2 = assert(ev:accept())
+    assert.equal(#list2, 2)
+
+    -- test that return empty list if no pending connections exist
+    assert.equal(assert(ev:accept(0)), {})
+
+    for _, fd in ipairs(list2) do
+        list[#list + 1] = fd
+    end
+    for _, fd in ipairs(list) do
+        assert(kq2:close_fd(fd))
+    end
+    for _, c in ipairs(clients) do
+        c:close()
+    end
+    srv:close()
+end
+
+function testcase.recv_msgs()
+    local kq = assert(kqueue.new())
+    local ev = kq:new_event()
+    assert(ev:as_read(TMPFD))
+
+    -- test that return error if descriptor is not a socket
+    local msgs = {}
+    local n, err, errnum = ev:recv_msgs(msgs, {}, 4, 1024)
+    assert.is_nil(n)
+    assert.equal(err, errno.ENOTSOCK.message)
+    assert.equal(errnum, errno.ENOTSOCK.code)
+    assert.equal(msgs, {})
+
+    -- test that throws an error if invalid arguments
+    err = assert.throws(function()
+        ev:recv_msgs()
+    end)
+    assert.match(err, 'table expected')
+    err = assert.throws(function()
+        ev:recv_msgs({}, nil, 0)
+    end)
+    assert.match(err, 'max must be > 0')
+    err = assert.throws(function()
+        ev:recv_msgs({}, nil, 2 ^ 32 + 1)
+    end)
+    assert.match(err, 'max must be <= ')
+    err = assert.throws(function()
+        ev:recv_msgs({}, nil, 1, 0)
+    end)
+    assert.match(err, 'bufsize must be > 0')
+end
+
+function testcase.idle_timeout()
+    local kq = assert(kqueue.new())
+    local p = assert(pipe())
+    local ev = kq:new_event()
+    assert(ev:as_read(p.reader:fd(), 'hello'))
+
+    -- test that set the idle timeout
+    assert.equal(ev:idle_timeout(0.05), 0)
+    assert.equal(ev:idle_timeout(), 0.05)
+
+    -- test that the activity resets the idle timeout
+    assert(p:write('x'))
+    assert.equal(assert(kq:wait(1)), 1)
+    assert.equal(kq:consume(), ev)
+    assert(p.reader:read(1))
+
+    -- test that the expired idle timeout is delivered with ETIMEDOUT
+    assert.equal(assert(kq:wait(1)), 1)
+    local oev, udata, disabled, eof, err, errnum = kq:consume()
+    assert.equal(oev, ev)
+    assert.equal(udata, 'hello')
+    assert.is_false(disabled)
+    assert.is_nil(eof)
+    assert.equal(err, errno.ETIMEDOUT.message)
+    assert.equal(errnum, errno.ETIMEDOUT.code)
+    assert.is_true(ev:is_enabled())
+
+    -- test that the idle timeout is disabled
+    assert.equal(ev:idle_timeout(0), 0.05)
+    assert.equal(assert(kq:wait(0.1)), 0)
+
+    -- test that throws an error if invalid timeout
+    err = assert.throws(ev.idle_timeout, ev, -1)
+    assert.match(err, 'sec must be >= 0')
+end
+
+function testcase.mark_ready()
+    local kq = assert(kqueue.new())
+    local p = assert(pipe())
+    local ev = kq:new_event()
+    assert(ev:as_edge())
+    assert(ev:as_read(p.reader:fd()))
+    assert(p:write('test'))
+    assert.equal(assert(kq:wait(1)), 1)
+    assert.equal(kq:consume(), ev)
+
+    -- test that the marked event is re-delivered by the next wait only once
+    assert.is_true(ev:mark_ready())
+    assert.is_true(ev:mark_ready())
+    assert.is_nil(kq:consume())
+    assert.equal(assert(kq:wait()), 1)
+    assert.equal(kq:consume(), ev)
+    assert.is_nil(kq:consume())
+    assert.equal(assert(kq:wait(0.01)), 0)
+
+    -- test that return false if event is not watched
+    assert(ev:unwatch())
+    assert.is_false(ev:mark_ready())
+end
+
 function testcase.is_enabled()
     local kq = assert(kqueue.new())
     local ev = kq:new_event()
@@ -188,6 +369,50 @@ function testcase.as_oneshot_is_oneshot()
     assert.equal(errnum, errno.EINPROGRESS.code)
 end
 
+function testcase.as_exclusive_is_exclusive()
+    local kq1 = assert(kqueue.new())
+    local kq2 = assert(kqueue.new())
+    local p = assert(pipe())
+    local ev1 = kq1:new_event()
+    assert(ev1:as_read(p.reader:fd()))
+    local ev2 = kq2:new_event()
+    assert(ev2:as_read(p.reader:fd()))
+
+    -- test that set the exclusive flag to the watched event
+    assert.is_false(ev1:is_exclusive())
+    assert.equal(assert(ev1:as_exclusive(0.1)), ev1)
+    assert.is_true(ev1:is_exclusive())
+    assert.is_true(ev1:is_level())
+    assert.is_true(ev1:is_enabled())
+
+    -- test that the exclusive event is disabled until the holdoff elapsed
+    -- while the other kqueue instance receives the event
+    assert(p:write('x'))
+    assert.equal(assert(kq1:wait(1)), 1)
+    assert.equal(kq1:consume(), ev1)
+    assert.equal(assert(kq1:wait(0)), 0)
+    assert.equal(assert(kq2:wait(0)), 1)
+    assert.equal(kq2:consume(), ev2)
+    assert.is_true(ev1:is_enabled())
+
+    -- test that the exclusive event is re-enabled by the wait
+    local t = kqueue.clock()
+    assert.equal(assert(kq1:wait(1)), 1)
+    assert.equal(kq1:consume(), ev1)
+    assert.greater(kqueue.clock() - t, 0.05)
+
+    -- test that the exclusive event is re-enabled by the next wait
+    assert(ev1:as_exclusive())
+    assert.equal(assert(kq1:wait(1)), 1)
+    assert.equal(kq1:consume(), ev1)
+    assert.equal(assert(kq1:wait(1)), 1)
+    assert.equal(kq1:consume(), ev1)
+
+    -- test that throws an error if invalid holdoff
+    local err = assert.throws(ev1.as_exclusive, ev1, -1)
+    assert.match(err, 'holdoff must be >= 0')
+end
+
 function testcase.ident()
     local kq = assert(kqueue.new())
     local ev = kq:new_event()
@@ -96,6 +96,77 @@ function testcase.watch_unwatch()
     assert.is_nil(errnum)
 end
 
+function testcase.ignore_and_count()
+    local kq = assert(kqueue.new())
+    local ev = kq:new_event()
+    local pid = getpid()
+
+    -- test that the default action of the signal is ignored while watching
+    assert(ev:as_signal(signal.SIGUSR1, 'usr1', true))
+    assert(signal.kill(signal.SIGUSR1, pid))
+    assert(signal.kill(signal.SIGUSR1, pid))
+    assert.equal(assert(kq:wait(1)), 1)
+    local oev, udata = assert(kq:consume())
+    assert.equal(oev, ev)
+    assert.equal(udata, 'usr1')
+
+    -- test that return the coalesced number of deliveries
+    local n, signo = ev:count()
+    assert.equal(n, 2)
+    assert.equal(signo, signal.SIGUSR1)
+    assert(ev:unwatch())
+end
+
+function testcase.signal_set()
+    local kq = assert(kqueue.new())
+    local ev = kq:new_event()
+    local pid = getpid()
+
+    -- test that watch the signal set with one event
+    assert(ev:as_signal({
+        signal.SIGUSR2,
+        signal.SIGUSR1,
+    }, 'set', true))
+    assert.equal(#kq, 2)
+    assert.equal(ev:ident(), math.min(signal.SIGUSR1, signal.SIGUSR2))
+    assert(signal.kill(signal.SIGUSR1, pid))
+    assert(signal.kill(signal.SIGUSR2, pid))
+    assert.equal(assert(kq:wait(1)), 2)
+    local signos = {}
+    for _ = 1, 2 do
+        local oev, udata = assert(kq:consume())
+        assert.equal(oev, ev)
+        assert.equal(udata, 'set')
+        local n, signo = ev:count()
+        assert.equal(n, 1)
+        signos[signo] = true
+    end
+    assert.equal(signos, {
+        [signal.SIGUSR1] = true,
+        [signal.SIGUSR2] = true,
+    })
+
+    -- test that unwatch all signals
+    assert(ev:unwatch())
+    assert.equal(#kq, 0)
+
+    -- test that return error if the signal set contains invalid signal
+    assert(ev:revert())
+    local _, err, errnum = ev:as_signal({
+        signal.SIGUSR1,
+        1234567890,
+    })
+    assert.is_nil(_)
+    assert.equal(err, errno.EINVAL.message)
+    assert.equal(errnum, errno.EINVAL.code)
+
+    -- test that return error if the signal set is empty
+    _, err, errnum = ev:as_signal({})
+    assert.is_nil(_)
+    assert.equal(err, errno.EINVAL.message)
+    assert.equal(errnum, errno.EINVAL.code)
+end
+
 function testcase.is_enabled()
     local kq = assert(kqueue.new())
     local ev = kq:new_event()
@@ -82,6 +82,60 @@ function testcase.watch_unwatch()
     assert.is_nil(errnum)
 end
 
+function testcase.modify()
+    local kq = assert(kqueue.new())
+    local ev = kq:new_event()
+    assert(ev:as_timer(1, 10))
+
+    -- test that modify the interval of the enabled timer in place
+    assert(ev:modify({
+        sec = 0.01,
+        udata = 'modified',
+    }))
+    assert.is_true(ev:is_enabled())
+    assert.equal(#kq, 1)
+    assert.equal(ev:getinfo('registered').data, 10)
+    assert.equal(assert(kq:wait(1)), 1)
+    local oev, udata = assert(kq:consume())
+    assert.equal(oev, ev)
+    assert.equal(udata, 'modified')
+
+    -- test that modify the trigger of the enabled timer
+    assert(ev:modify({
+        trigger = 'oneshot',
+    }))
+    assert.is_true(ev:is_oneshot())
+    assert.equal(assert(kq:wait(1)), 1)
+    local _, _, disabled = assert(kq:consume())
+    assert.is_true(disabled)
+    assert.equal(#kq, 0)
+
+    -- test that modify the unwatched timer
+    assert(ev:modify({
+        trigger = 'level',
+        sec = 0.02,
+    }))
+    assert.is_false(ev:is_enabled())
+    assert.is_true(ev:is_level())
+    assert.equal(ev:getinfo('registered').data, 20)
+
+    -- test that return error if sec is negative
+    local ok, err, errnum = ev:modify({
+        sec = -1,
+    })
+    assert.is_false(ok)
+    assert.equal(err, errno.EINVAL.message)
+    assert.equal(errnum, errno.EINVAL.code)
+
+    -- test that throws an error if invalid trigger
+    err = assert.throws(function()
+        ev:modify({
+            trigger = 'invalid',
+        })
+    end)
+    assert.match(err, 'invalid trigger invalid')
+end
+
 function testcase.is_enabled()
     local kq = assert(kqueue.new())
     local ev = kq:new_event()
@@ -208,3 +262,51 @@ function testcase.getinfo()
     assert.match(err, 'invalid option')
 end
 
+
+function testcase.auto_ident()
+    local kq = assert(kqueue.new())
+    local ev1 = kq:new_event()
+    local ev2 = kq:new_event()
+    local ev3 = kq:new_event()
+
+    -- test that ident is allocated automatically if nil
+    assert(ev1:as_timer(nil, 1.0))
+    assert(ev2:as_timer(nil, 1.0))
+    assert.equal(ev1:ident(), 1)
+    assert.equal(ev2:ident(), 2)
+
+    -- test that explicit ident is skipped
+    assert(ev3:as_timer(3, 1.0))
+    local ev4 = kq:new_event()
+    assert(ev4:as_timer(nil, 1.0))
+    assert.equal(ev4:ident(), 4)
+
+    -- test that ident is recycled when the event is unwatched
+    assert(ev1:unwatch())
+    local ev5 = kq:new_event()
+    assert(ev5:as_timer(nil, 1.0))
+    assert.equal(ev5:ident(), 1)
+
+    -- test that the skipped ident is reused after the explicit ident event is
+    -- released
+    assert(ev3:revert())
+    assert(ev1:watch())
+    assert.equal(ev1:ident(), 3)
+
+    -- test that the next ident is allocated if no released ident exists
+    local ev6 = kq:new_event()
+    assert(ev6:as_timer(nil, 1.0))
+    assert.equal(ev6:ident(), 5)
+
+    -- test that the released ident that is used by the explicit ident event
+    -- is reused after the explicit ident event is released
+    assert(ev6:unwatch())
+    local ev7 = kq:new_event()
+    assert(ev7:as_timer(5, 1.0))
+    assert(ev6:watch())
+    assert.equal(ev6:ident(), 6)
+    assert(ev7:revert())
+    local ev8 = kq:new_event()
+    assert(ev8:as_timer(nil, 1.0))
+    assert.equal(ev8:ident(), 5)
+end
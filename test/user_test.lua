@@ -0,0 +1,63 @@
+local testcase = require('testcase')
+local kqueue = require('kqueue')
+local errno = require('errno')
+
+if not kqueue.usable() then
+    return
+end
+
+function testcase.type()
+    local kq = assert(kqueue.new())
+    local ev = kq:new_event()
+    assert(ev:as_user(1))
+
+    -- test that get the event type
+    assert.equal(ev:type(), 'user')
+end
+
+function testcase.revert()
+    local kq = assert(kqueue.new())
+    local ev = kq:new_event()
+    assert(ev:as_user(1))
+    assert.match(ev, '^kqueue%.user: ', false)
+
+    -- test that revert event to initial state
+    assert(ev:revert())
+    assert.match(ev, '^kqueue%.event: ', false)
+end
+
+function testcase.trigger()
+    local kq = assert(kqueue.new())
+    local ev = kq:new_event()
+    assert(ev:as_user(1, 'context'))
+
+    -- test that no event occurs until triggered
+    assert.equal(assert(kq:wait(0.01)), 0)
+
+    -- test that event occurs when triggered
+    assert(ev:trigger())
+    assert.equal(assert(kq:wait()), 1)
+    local oev, udata, disabled = kq:consume()
+    assert.equal(oev, ev)
+    assert.equal(udata, 'context')
+    assert.is_nil(disabled)
+
+    -- test that event state is reset after it is delivered
+    assert.equal(assert(kq:wait(0.01)), 0)
+
+    -- test that event can be triggered by descriptor and ident
+    assert(kqueue.trigger(kq:fd(), 1))
+    assert.equal(assert(kq:wait()), 1)
+    assert.equal(kq:consume(), ev)
+
+    -- test that return error if event is not registered
+    local ok, err, errnum = kqueue.trigger(kq:fd(), 2)
+    assert.is_false(ok)
+    assert.equal(err, errno.ENOENT.message)
+    assert.equal(errnum, errno.ENOENT.code)
+    assert(ev:unwatch())
+    ok, err, errnum = ev:trigger()
+    assert.is_false(ok)
+    assert.equal(err, errno.ENOENT.message)
+    assert.equal(errnum, errno.ENOENT.code)
+end
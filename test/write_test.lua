@@ -2,6 +2,8 @@ local testcase = require('testcase')
 local kqueue = require('kqueue')
 local fileno = require('io.fileno')
 local errno = require('errno')
+local pipe = require('os.pipe.io')
+local socket = require('socket')
 
 if not kqueue.usable() then
     return
@@ -93,6 +95,242 @@ function testcase.watch_unwatch()
     assert.is_nil(errnum)
 end
 
+function testcase.enqueue()
+    local kq = assert(kqueue.new())
+    local ev = kq:new_event()
+    assert(ev:as_write(TMPFD))
+
+    -- test that queued strings are written immediately
+    assert.equal(assert(ev:enqueue('hello', ' ', 'world', 123)), 0)
+    assert.equal(ev:pending(), 0)
+    TMPFILE:seek('set')
+    assert.equal(TMPFILE:read('*a'), 'hello world123')
+
+    -- test that write interest is disabled while no data is pending without
+    -- removing the registration
+    assert.is_true(ev:is_enabled())
+    assert.equal(#kq, 1)
+    assert.equal(assert(kq:wait(0)), 0)
+
+    -- test that throws an error if argument is not string
+    local err = assert.throws(function()
+        ev:enqueue({})
+    end)
+    assert.match(err, 'string expected')
+end
+
+function testcase.enqueue_msg()
+    local kq = assert(kqueue.new())
+    local ev = kq:new_event()
+    assert(ev:as_write(TMPFD))
+
+    -- test that return error if descriptor is not a socket
+    local nbyte, err, errnum = ev:enqueue_msg('hello')
+    assert.is_nil(nbyte)
+    assert.equal(err, errno.ENOTSOCK.message)
+    assert.equal(errnum, errno.ENOTSOCK.code)
+
+    -- test that the datagram that cannot be sent is dropped
+    assert.equal(ev:pending(), 0)
+
+    -- test that throws an error if argument is not string
+    err = assert.throws(function()
+        ev:enqueue_msg({})
+    end)
+    assert.match(err, 'string expected')
+    err = assert.throws(function()
+        ev:enqueue_msg('hello', {})
+    end)
+    assert.match(err, 'string expected')
+end
+
+function testcase.enqueue_msg_loopback()
+    local kq = assert(kqueue.new())
+    local srv = assert(socket.udp())
+    assert(srv:setsockname('127.0.0.1', 0))
+    local cli = assert(socket.udp())
+    local ip, port = srv:getsockname()
+    assert(cli:setpeername(ip, port))
+    local wev = assert(kq:new_event():as_write(cli:getfd()))
+    local rev = assert(kq:new_event():as_read(srv:getfd()))
+
+    -- test that send the datagrams to the connected peer
+    assert.equal(assert(wev:enqueue_msg('hello')), 0)
+    assert.equal(assert(wev:enqueue_msg('world')), 0)
+    local msgs = {}
+    local addrs = {}
+    local n = 0
+    while n < 2 do
+        assert(kq:wait(1))
+        if kq:consume() == rev then
+            n = n + assert(rev:recv_msgs(msgs, addrs, 4, 1024))
+        end
+    end
+    assert.equal(msgs, {
+        'hello',
+        'world',
+    })
+    assert.equal(type(addrs[1]), 'string')
+
+    -- test that send the datagram to the received source address
+    local sev = assert(kq:new_event():as_write(srv:getfd()))
+    assert.equal(assert(sev:enqueue_msg('reply', addrs[1])), 0)
+    cli:settimeout(1)
+    assert.equal(assert(cli:receive()), 'reply')
+    cli:close()
+    srv:close()
+end
+
+function testcase.sendfile()
+    local kq = assert(kqueue.new())
+    local ev = kq:new_event()
+    local f = assert(io.tmpfile())
+    assert(f:write('hello sendfile'))
+    f:flush()
+    assert(ev:as_write(TMPFD, 'context'))
+
+    -- test that the job is completed with a single event
+    assert(ev:sendfile(fileno(f), 6))
+    assert.equal(ev:pending(), 8)
+    assert.equal(assert(kq:wait()), 1)
+    local oev, ctx, disabled, eof, err = kq:consume()
+    assert.equal(oev, ev)
+    assert.equal(ctx, 'context')
+    assert.is_true(disabled)
+    assert.is_nil(eof)
+    assert.is_nil(err)
+    assert.equal(ev:pending(), 0)
+    assert.is_false(ev:is_enabled())
+    TMPFILE:seek('set')
+    assert.equal(TMPFILE:read('*a'), 'sendfile')
+
+    -- test that return error if the job is pending
+    assert(ev:sendfile(fileno(f), 0, 5))
+    local ok, errnum
+    ok, err, errnum = ev:sendfile(fileno(f))
+    assert.is_false(ok)
+    assert.equal(err, errno.EBUSY.message)
+    assert.equal(errnum, errno.EBUSY.code)
+    f:close()
+
+    -- test that throws an error if invalid arguments
+    err = assert.throws(function()
+        ev:sendfile(0, -1)
+    end)
+    assert.match(err, 'offset must be >= 0')
+    err = assert.throws(function()
+        ev:sendfile(0, 0, -1)
+    end)
+    assert.match(err, 'length must be >= 0')
+end
+
+function testcase.sendfile_eof()
+    local kq = assert(kqueue.new())
+    local ev = kq:new_event()
+    local f = assert(io.tmpfile())
+    assert(f:write('hello sendfile'))
+    f:flush()
+    local p = assert(pipe(true))
+    p.reader:close()
+    assert(ev:as_write(p.writer:fd()))
+
+    -- test that the job is abandoned when the peer is closed
+    assert(ev:sendfile(fileno(f)))
+    assert.equal(assert(kq:wait(1)), 1)
+    local oev, _, disabled, eof = kq:consume()
+    assert.equal(oev, ev)
+    assert.is_true(disabled)
+    assert.is_true(eof)
+    assert.equal(ev:pending(), 0)
+
+    -- test that the job context is detached from the event
+    local _, _, errnum = ev:sendfile(fileno(f))
+    assert.not_equal(errnum, errno.EBUSY.code)
+    ev:unwatch()
+    f:close()
+end
+
+function testcase.watermark()
+    local kq = assert(kqueue.new())
+    local ev = kq:new_event()
+    assert(ev:as_write(TMPFD))
+
+    -- test that set watermarks
+    assert(ev:watermark(1024, 4096))
+    assert(ev:watermark())
+
+    -- test that throws an error if invalid watermarks
+    local err = assert.throws(function()
+        ev:watermark(-1)
+    end)
+    assert.match(err, 'lowat must be >= 0')
+    err = assert.throws(function()
+        ev:watermark(1024, 1)
+    end)
+    assert.match(err, 'hiwat must be 0 or >= lowat')
+end
+
+-- read all data from the non-blocking descriptor
+local function drain(fd)
+    local kq = assert(kqueue.new())
+    local nbyte = 0
+    while true do
+        local op = assert(kq:async_read(fd, 65536))
+        if op:is_enabled() then
+            -- no more data
+            op:cancel()
+            return nbyte
+        end
+        assert(kq:wait(0))
+        assert.equal(kq:consume(), op)
+        nbyte = nbyte + #op:result()
+    end
+end
+
+function testcase.watermark_backpressure()
+    local kq = assert(kqueue.new())
+    local p = assert(pipe(true))
+    local ev = assert(kq:new_event():as_write(p.writer:fd(), 'context'))
+    assert(ev:watermark(1024, 4096))
+
+    -- test that the data that cannot be written immediately is queued
+    local data = string.rep('x', 1024 * 1024)
+    local nbyte = assert(ev:enqueue(data))
+    assert.greater(nbyte, 4096)
+    assert.equal(ev:pending(), nbyte)
+    assert.is_true(ev:is_enabled())
+    assert.equal(#kq, 1)
+
+    -- test that the event is not delivered while the descriptor is full
+    assert(kq:wait(0))
+    assert.is_nil(kq:consume())
+
+    -- test that the event is delivered when the pending bytes fall below
+    -- the low watermark
+    local total = 0
+    local oev, ctx
+    repeat
+        total = total + drain(p.reader:fd())
+        assert(kq:wait(1))
+        oev, ctx = kq:consume()
+    until oev
+    assert.equal(oev, ev)
+    assert.equal(ctx, 'context')
+    assert.is_true(ev:pending() <= 1024)
+    assert.is_true(ev:is_enabled())
+    assert.equal(#kq, 1)
+    while ev:pending() > 0 do
+        total = total + drain(p.reader:fd())
+        assert(kq:wait(1))
+        assert.is_nil(kq:consume())
+    end
+    total = total + drain(p.reader:fd())
+    assert.equal(total, #data)
+
+    -- test that the write interest is disabled after the queue is flushed
+    assert.equal(assert(kq:wait(0)), 0)
+end
+
 function testcase.is_enabled()
     local kq = assert(kqueue.new())
     local ev = kq:new_event()